@@ -0,0 +1,420 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include "tests/random.hpp"
+
+std::filesystem::path outpath;
+std::filesystem::path workdir = std::filesystem::temp_directory_path() / "nspre-bench";
+
+bool quiet = false;
+int repetitions = 3;
+size_t case_bytes = 16 << 20;
+unsigned int threads = 1;
+
+// The largest count is past NSPRE_MAX_COUNT, so archives are written and opened with max_count
+// raised.
+const int entry_counts[] = { 1, 16, NSPRE_MAX_COUNT, 4096 };
+const char* const entropies[] = { "low", "medium", "high" };
+const int compressed_percents[] = { 0, 50, 100 };
+
+struct Result {
+	const char* name;
+	double seconds;
+	size_t bytes;
+	int entries;
+};
+
+struct Case {
+	int entries;
+	const char* entropy;
+	int requested_percent;        // Share of entries written with compression on.
+	int compressed_percent = 0;   // Share that ended up compressed, the rest didn't shrink and are stored.
+	size_t bytes = 0;
+	size_t archive_bytes = 0;
+	std::vector<Result> results;
+};
+
+void print_help() {
+	std::printf(
+		"nspre-bench - Measure pre file throughput on generated archives.\n"
+		"Usage: nspre-bench [OPTIONS]\n"
+		"  -o  Write JSON results to a file instead of stdout\n"
+		"  -d  Directory for generated archives. Default is a temporary directory\n"
+		"  -r  Repetitions of each measurement, the fastest is reported. Default is 3\n"
+		"  -s  Uncompressed MiB per archive. Default is 16\n"
+		"  -j  Number of threads to compress with. 0 uses one per core. Default is 1\n"
+		"  -q  Quiet - Don't show progress\n"
+		"  -h  Show this help message\n"
+		"\n"
+	);
+}
+
+bool arg_proc(int argc, char** argv) {
+	for (int i = 1; i < argc; ++i) {
+		bool has_val = false;
+		if (argc > i + 1) has_val = true;
+
+		if (std::strcmp(argv[i], "-h") == 0) {
+			print_help();
+			return true;
+		}
+		else if (std::strcmp(argv[i], "-q") == 0) {
+			quiet = true;
+		}
+		else if (has_val && std::strcmp(argv[i], "-o") == 0) {
+			outpath = argv[++i];
+		}
+		else if (has_val && std::strcmp(argv[i], "-d") == 0) {
+			workdir = argv[++i];
+		}
+		else if (has_val && std::strcmp(argv[i], "-r") == 0) {
+			repetitions = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (has_val && std::strcmp(argv[i], "-s") == 0) {
+			case_bytes = static_cast<size_t>(std::max(std::atoi(argv[++i]), 1)) << 20;
+		}
+		else if (has_val && std::strcmp(argv[i], "-j") == 0) {
+			threads = std::atoi(argv[++i]);
+		}
+	}
+
+	return false;
+}
+
+// low is text built from a small vocabulary and compresses well, medium is random bytes from a
+// 16 symbol alphabet with few repeats for the compressor to find, high is uniformly random.
+std::vector<char> generate(size_t size, const char* entropy, uint64_t seed) {
+	static const char* const words[] = {
+		"the ", "model ", "texture ", "sound ", "level ", "data ", "file ", "of ",
+		"and ", "player ", "enemy ", "stage ", "light ", "camera ", "script ", "\n"
+	};
+
+	Random random{ seed * 0x9e3779b97f4a7c15ull + 1 };
+	std::vector<char> data;
+	data.reserve(size + 16);
+
+	if (std::strcmp(entropy, "low") == 0) {
+		while (data.size() < size) {
+			const char* word = words[random.next() % 16];
+			data.insert(data.end(), word, word + std::strlen(word));
+		}
+	}
+	else if (std::strcmp(entropy, "medium") == 0) {
+		while (data.size() < size) {
+			uint64_t r = random.next();
+			for (int i = 0; i < 16; ++i) {
+				data.push_back('a' + ((r >> (i * 4)) & 0xf));
+			}
+		}
+	}
+	else {
+		while (data.size() < size) {
+			uint64_t r = random.next();
+			data.insert(data.end(), reinterpret_cast<char*>(&r), reinterpret_cast<char*>(&r) + 8);
+		}
+	}
+
+	data.resize(size);
+	return data;
+}
+
+std::string entry_path(int i) {
+	char path[32];
+	std::snprintf(path, sizeof(path), "bench\\entry%03d.bin", i);
+	return path;
+}
+
+// Offsets of the subheader of each entry in an archive held in memory.
+std::vector<size_t> entry_offsets(const std::vector<char>& archive) {
+	std::vector<size_t> offsets;
+	int count = nspre::Read32LE<int>(archive.data() + 8);
+	size_t pos = 12;
+
+	for (int i = 0; i < count; ++i) {
+		offsets.push_back(pos);
+		int size = nspre::Read32LE<int>(archive.data() + pos);
+		int cmp_size = nspre::Read32LE<int>(archive.data() + pos + 4);
+		int path_size = nspre::Read32LE<int>(archive.data() + pos + 8);
+		int file_size = cmp_size ? cmp_size : size;
+		pos += 16 + path_size + file_size + ((file_size % 4) ? 4 - (file_size % 4) : 0);
+	}
+
+	offsets.push_back(pos);
+	return offsets;
+}
+
+// Writer compresses either every entry or none, so archives with a mix are put together from
+// one archive of each kind, taking every entry from whichever one it was supposed to be in.
+std::vector<char> splice(const std::vector<char>& compressed, const std::vector<char>& stored, const std::vector<bool>& is_compressed) {
+	std::vector<size_t> cmp_offsets = entry_offsets(compressed);
+	std::vector<size_t> stored_offsets = entry_offsets(stored);
+	std::vector<char> archive(compressed.begin(), compressed.begin() + 12);
+	size_t cmp_i = 0;
+	size_t stored_i = 0;
+
+	for (bool c : is_compressed) {
+		const std::vector<char>& from = c ? compressed : stored;
+		const std::vector<size_t>& offsets = c ? cmp_offsets : stored_offsets;
+		size_t& i = c ? cmp_i : stored_i;
+		archive.insert(archive.end(), from.begin() + offsets[i], from.begin() + offsets[i + 1]);
+		++i;
+	}
+
+	nspre::Write32LE<int>(archive.data(), static_cast<int>(archive.size()));
+	nspre::Write32LE<int>(archive.data() + 8, static_cast<int>(is_compressed.size()));
+	return archive;
+}
+
+// Runs f repetitions times and returns the fastest time in seconds.
+template <typename F>
+double measure(F&& f) {
+	double best = 0;
+	for (int r = 0; r < repetitions; ++r) {
+		auto start = std::chrono::steady_clock::now();
+		if (!f()) return -1;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (r == 0 || seconds < best) best = seconds;
+	}
+
+	return best;
+}
+
+bool run_case(Case& bench) {
+	size_t entry_size = case_bytes / bench.entries;
+	std::vector<std::vector<char>> entries;
+	std::vector<bool> is_compressed;
+
+	for (int i = 0; i < bench.entries; ++i) {
+		entries.push_back(generate(entry_size, bench.entropy, i));
+		is_compressed.push_back((i * 100 / bench.entries) < bench.requested_percent);
+		bench.bytes += entry_size;
+	}
+
+	// Write every entry both ways so the time includes the same amount of work no matter the mix.
+	std::vector<char> compressed;
+	std::vector<char> stored;
+	auto write = [&](bool compress, std::vector<char>& archive) {
+		nspre::WriterOptions options;
+		options.compress = compress;
+		options.threads = threads;
+		options.max_count = 4096;
+
+		nspre::Writer writer(options);
+		for (int i = 0; i < bench.entries; ++i) {
+			if (is_compressed[i] == compress) {
+				writer.add(entries[i].data(), entries[i].size(), entry_path(i));
+			}
+		}
+
+		return writer.write(archive) == 0;
+	};
+
+	double seconds = measure([&]() {
+		return write(true, compressed) && write(false, stored);
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "write", seconds, bench.bytes, bench.entries });
+
+	std::vector<char> archive = splice(compressed, stored, is_compressed);
+	bench.archive_bytes = archive.size();
+
+	std::filesystem::path path = workdir / "bench.pre";
+	{
+		std::ofstream ostream(path, std::ios::binary);
+		ostream.write(archive.data(), archive.size());
+		if (ostream.fail()) return false;
+	}
+
+	nspre::ReaderOptions reader_options;
+	reader_options.max_count = 4096;
+
+	seconds = measure([&]() {
+		nspre::Reader reader(path, reader_options);
+		return reader.error() == 0;
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "open", seconds, bench.archive_bytes, bench.entries });
+
+	nspre::Reader reader(path, reader_options);
+	if (reader.error() || reader.files().size() != entries.size()) return false;
+
+	int compressed_count = 0;
+	for (nspre::Reader::Subfile& subfile : reader.files()) {
+		if (subfile.cmp_size() != 0) ++compressed_count;
+	}
+
+	bench.compressed_percent = compressed_count * 100 / bench.entries;
+
+	std::vector<char> out;
+	seconds = measure([&]() {
+		for (int i = 0; i < bench.entries; ++i) {
+			if (reader.files()[i].extract(out) || out != entries[i]) return false;
+		}
+		return true;
+	});
+	if (seconds < 0) return false;
+
+	// The comparison above is only there to catch a broken build, time the extraction alone.
+	seconds = measure([&]() {
+		for (nspre::Reader::Subfile& subfile : reader.files()) {
+			if (subfile.extract(out)) return false;
+		}
+		return true;
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "extract_vector", seconds, bench.bytes, bench.entries });
+
+	std::filesystem::path extract_path = workdir / "extract.bin";
+	seconds = measure([&]() {
+		for (nspre::Reader::Subfile& subfile : reader.files()) {
+			if (subfile.extract(extract_path)) return false;
+		}
+		return true;
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "extract_file", seconds, bench.bytes, bench.entries });
+
+	size_t total = 0;
+	nspre::Reader::Outfunc outfunc = [&total](const char*, size_t size) {
+		total += size;
+		return 0;
+	};
+	seconds = measure([&]() {
+		for (nspre::Reader::Subfile& subfile : reader.files()) {
+			if (subfile.extract(outfunc)) return false;
+		}
+		return true;
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "extract_callback", seconds, bench.bytes, bench.entries });
+
+	auto sink = [&total](const char*, size_t size) {
+		total += size;
+		return 0;
+	};
+	seconds = measure([&]() {
+		for (nspre::Reader::Subfile& subfile : reader.files()) {
+			if (subfile.extract(sink)) return false;
+		}
+		return true;
+	});
+	if (seconds < 0) return false;
+	bench.results.push_back({ "extract_sink", seconds, bench.bytes, bench.entries });
+
+	return true;
+}
+
+void print_json(std::FILE* out, const std::vector<Case>& cases) {
+	std::fprintf(out, "{\n");
+	std::fprintf(out, "  \"repetitions\": %d,\n", repetitions);
+	std::fprintf(out, "  \"threads\": %u,\n", threads);
+	std::fprintf(out, "  \"cases\": [\n");
+
+	for (size_t c = 0; c < cases.size(); ++c) {
+		const Case& bench = cases[c];
+		std::fprintf(out, "    {\n");
+		std::fprintf(out, "      \"entries\": %d,\n", bench.entries);
+		std::fprintf(out, "      \"entropy\": \"%s\",\n", bench.entropy);
+		std::fprintf(out, "      \"requested_compressed_percent\": %d,\n", bench.requested_percent);
+		std::fprintf(out, "      \"compressed_percent\": %d,\n", bench.compressed_percent);
+		std::fprintf(out, "      \"bytes\": %zu,\n", bench.bytes);
+		std::fprintf(out, "      \"archive_bytes\": %zu,\n", bench.archive_bytes);
+		std::fprintf(out, "      \"results\": {\n");
+
+		for (size_t r = 0; r < bench.results.size(); ++r) {
+			const Result& result = bench.results[r];
+			std::fprintf(
+				out,
+				"        \"%s\": { \"seconds\": %.6f, \"mb_per_s\": %.2f, \"ns_per_entry\": %.1f }%s\n",
+				result.name,
+				result.seconds,
+				result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0.0,
+				result.seconds * 1e9 / result.entries,
+				r + 1 < bench.results.size() ? "," : ""
+			);
+		}
+
+		std::fprintf(out, "      }\n");
+		std::fprintf(out, "    }%s\n", c + 1 < cases.size() ? "," : "");
+	}
+
+	std::fprintf(out, "  ]\n");
+	std::fprintf(out, "}\n");
+}
+
+int main(int argc, char** argv) {
+	if (arg_proc(argc, argv)) {
+		return 0;
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(workdir, ec);
+	if (ec) {
+		std::fprintf(stderr, "can't create directory %s\n", workdir.string().c_str());
+		return -1;
+	}
+
+	std::vector<Case> cases;
+	for (int entries : entry_counts) {
+		for (const char* entropy : entropies) {
+			for (int percent : compressed_percents) {
+				Case& bench = cases.emplace_back();
+				bench.entries = entries;
+				bench.entropy = entropy;
+				bench.requested_percent = percent;
+
+				if (!quiet) {
+					std::fprintf(stderr, "entries %d, entropy %s, compressed %d%%\n", entries, entropy, percent);
+				}
+
+				if (!run_case(bench)) {
+					std::fprintf(stderr, "benchmark failed\n");
+					return -1;
+				}
+			}
+		}
+	}
+
+	std::filesystem::remove(workdir / "bench.pre", ec);
+	std::filesystem::remove(workdir / "extract.bin", ec);
+
+	std::FILE* out = stdout;
+	if (!outpath.empty()) {
+		out = std::fopen(outpath.string().c_str(), "w");
+		if (!out) {
+			std::fprintf(stderr, "can't open output file\n");
+			return -1;
+		}
+	}
+
+	print_json(out, cases);
+
+	if (out != stdout) {
+		std::fclose(out);
+	}
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+std::vector<std::filesystem::path> in_files;
+std::filesystem::path out_file = "out.pre";
+std::vector<std::string> includes;
+std::vector<std::string> excludes;
+bool keep_duplicates = false;
+bool quiet = false;
+
+void print_help() {
+	std::printf(
+		"ns-merge - Combine pre files or split files out of them without recompressing.\n"
+		"Usage: ns-merge [OPTIONS] [INPUT FILES]\n"
+		"  -o  Output file. Default is ./out.pre\n"
+		"  -i  Only take files whose internal path starts with this. Can be repeated\n"
+		"  -x  Leave out files whose internal path starts with this. Can be repeated\n"
+		"  -k  Keep duplicates - By default a file replaces an earlier one with the same\n"
+		"      internal path\n"
+		"  -q  Quiet - Don't show total size and number of files\n"
+		"  -h  Show this help message\n"
+		"\n"
+	);
+}
+
+bool arg_proc(int argc, char** argv) {
+	for (int i = 1; i < argc; ++i) {
+		bool has_val = false;
+		if (argc > i + 1) has_val = true;
+
+		if (std::strcmp(argv[i], "-h") == 0) {
+			print_help();
+			return true;
+		}
+		else if (std::strcmp(argv[i], "-k") == 0) {
+			keep_duplicates = true;
+		}
+		else if (std::strcmp(argv[i], "-q") == 0) {
+			quiet = true;
+		}
+		else if (has_val && std::strcmp(argv[i], "-o") == 0) {
+			out_file = argv[++i];
+		}
+		else if (has_val && std::strcmp(argv[i], "-i") == 0) {
+			includes.push_back(argv[++i]);
+		}
+		else if (has_val && std::strcmp(argv[i], "-x") == 0) {
+			excludes.push_back(argv[++i]);
+		}
+		else {
+			in_files.push_back(argv[i]);
+		}
+	}
+
+	return false;
+}
+
+// Internal paths are stored with back slashes and padded with nulls.
+std::string normalize(std::string path) {
+	path.resize(std::min(path.size(), path.find('\0')));
+	for (char& c : path) {
+		if (c == '/') c = '\\';
+	}
+
+	return path;
+}
+
+bool starts_with_any(const std::string& path, const std::vector<std::string>& prefixes) {
+	for (const std::string& prefix : prefixes) {
+		std::string p = normalize(prefix);
+		if (path.compare(0, p.size(), p) == 0) return true;
+	}
+
+	return false;
+}
+
+int main(int argc, char** argv) {
+	if (arg_proc(argc, argv)) {
+		return 0;
+	}
+
+	if (in_files.empty()) {
+		std::fprintf(stderr, "no input files\n");
+		print_help();
+		return -1;
+	}
+
+	// Inputs can be merged archives themselves, so they're opened with no limit short of the format's.
+	nspre::ReaderOptions options;
+	options.max_size = NSPRE_FORMAT_MAX_SIZE;
+	options.max_count = NSPRE_FORMAT_MAX_SIZE;
+
+	// Every input stays open until the output is written since Subfiles are copied from them then.
+	std::vector<std::unique_ptr<nspre::Reader>> readers;
+	std::vector<nspre::Reader::Subfile*> selected;
+	std::map<std::string, size_t> selected_index;
+
+	for (const std::filesystem::path& path : in_files) {
+		nspre::Reader& reader = *readers.emplace_back(std::make_unique<nspre::Reader>(path, options));
+		if (reader.error()) {
+			std::fprintf(stderr, "can't open input file %s\n", path.string().c_str());
+			return 1;
+		}
+
+		for (nspre::Reader::Subfile& subfile : reader.files()) {
+			std::string prepath = normalize(std::string(subfile.prepath()));
+			if (!includes.empty() && !starts_with_any(prepath, includes)) continue;
+			if (starts_with_any(prepath, excludes)) continue;
+
+			if (!keep_duplicates) {
+				auto it = selected_index.emplace(prepath, selected.size()).first;
+				if (it->second < selected.size()) {
+					selected[it->second] = &subfile;
+					continue;
+				}
+			}
+
+			selected.push_back(&subfile);
+		}
+	}
+
+	if (selected.size() > NSPRE_MAX_COUNT) {
+		std::fprintf(stderr, "warning: %zu files is more than NSPRE_MAX_COUNT (%d) and won't open unless ReaderOptions::max_count is raised\n", selected.size(), NSPRE_MAX_COUNT);
+	}
+
+	nspre::WriterOptions writer_options;
+	writer_options.max_size = NSPRE_FORMAT_MAX_SIZE;
+	writer_options.max_count = NSPRE_FORMAT_MAX_SIZE;
+
+	nspre::Writer writer(writer_options);
+	for (nspre::Reader::Subfile* subfile : selected) {
+		writer.add(*subfile);
+	}
+
+	// Written next to the output and moved over it afterwards, so the output can be one of the inputs.
+	std::filesystem::path temp = out_file;
+	temp += ".tmp";
+
+	if (int err = writer.write(temp)) {
+		std::error_code ec;
+		std::filesystem::remove(temp, ec);
+
+		switch (err) {
+		case nspre::Error::FILE_OPEN_OUTPUT:
+			std::fprintf(stderr, "can't open output file\n");
+			break;
+		case nspre::Error::READ_SUBFILE:
+			std::fprintf(stderr, "error reading input file\n");
+			break;
+		case nspre::Error::WRITE_SUBHEADER:
+		case nspre::Error::WRITE_SUBPATH:
+		case nspre::Error::WRITE_SUBFILE:
+			std::fprintf(stderr, "error writing file\n");
+			break;
+		case nspre::Error::TOO_LARGE:
+			std::fprintf(stderr, "output would be larger than a pre file can hold\n");
+			break;
+		default:
+			std::fprintf(stderr, "error (%d)\n", err);
+		}
+		return 1;
+	}
+
+	readers.clear();
+
+	std::error_code ec;
+	std::filesystem::rename(temp, out_file, ec);
+	if (ec) {
+		std::filesystem::remove(temp, ec);
+		std::fprintf(stderr, "can't open output file\n");
+		return 1;
+	}
+
+	uintmax_t size = std::filesystem::file_size(out_file, ec);
+	if (!ec && size > NSPRE_MAX_SIZE) {
+		std::fprintf(stderr, "warning: %ju bytes is more than NSPRE_MAX_SIZE (%d) and won't open unless ReaderOptions::max_size is raised\n", size, NSPRE_MAX_SIZE);
+	}
+
+	if (!quiet) {
+		std::printf("size: %ju\nfiles: %zu\n", size, selected.size());
+	}
+
+	return 0;
+}
@@ -20,12 +20,64 @@
 
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <memory>
 #include <type_traits>
+#include <algorithm>
 #include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <atomic>
+#include <cstdio>
+
+#include <chrono>
+
+// Only used in the file with NSPRE_IMPL. Everything else in the library is the same with or
+// without NSPRE_STATS.
+#ifdef NSPRE_STATS
+#define NSPRE_STAT(x) x
+#define NSPRE_STATS_ON true
+#else
+#define NSPRE_STAT(x)
+#define NSPRE_STATS_ON false
+#endif
+
+#if __has_include(<version>)
+#include <version>
+#endif
+
+#ifdef __cpp_lib_span
+#include <span>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NSPRE_POSIX 1
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define NSPRE_CRC_CLMUL 1
+#endif
+
+#if defined(NSPRE_IMPL) && defined(NSPRE_POSIX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+#if defined(NSPRE_IMPL) && defined(NSPRE_CRC_CLMUL)
+#include <immintrin.h>
+#endif
 
 #define NSPRE_VERSION_MAJOR 1
 #define NSPRE_VERSION_MINOR 0
@@ -35,6 +87,7 @@
 #define NSPRE_MIN_SIZE 36
 #endif
 
+// Defaults for ReaderOptions and WriterOptions max_size and max_count.
 #ifndef NSPRE_MAX_SIZE
 #define NSPRE_MAX_SIZE 524288000
 #endif
@@ -43,6 +96,14 @@
 #define NSPRE_MAX_COUNT 200
 #endif
 
+// Sizes and offsets are stored as signed 32 bit values, so no pre file can be larger than this
+// whatever the limits are set to.
+#define NSPRE_FORMAT_MAX_SIZE 2147483647
+
+#ifndef NSPRE_INDEX_WINDOW
+#define NSPRE_INDEX_WINDOW 65536
+#endif
+
 #ifndef NSPRE_PATH_MAX
 #define NSPRE_PATH_MAX 256
 #endif
@@ -59,13 +120,19 @@ enum Error : int {
 	READ_SUBHEADER = 3,
 	READ_SUBPATH = 4,
 	BAD_FILE = 5,
+	FILE_MAP = 6,
+	BAD_CHECKSUM = 7,
 	READ_SUBFILE = 256,
 	EXTRACT_SUBFILE = 257,
 	FILE_OPEN_OUTPUT = 258,
+	DECODE_SUBFILE = 259,
 	WRITE_HEADER = 65536,
 	WRITE_SUBHEADER = 65537,
 	WRITE_SUBPATH = 65538,
-	WRITE_SUBFILE = 65539
+	WRITE_SUBFILE = 65539,
+	READ_SOURCE = 65540,
+	TOO_LARGE = 65541,
+	NOT_FOUND = 65542
 };
 
 class SubfileBase {
@@ -77,39 +144,181 @@ public:
 	std::string filename() const;
 };
 
+enum Advice : int {
+	NORMAL = 0,
+	SEQUENTIAL = 1,
+	RANDOM = 2,
+	WILLNEED = 3
+};
+
+struct ReaderOptions {
+	bool map = false;
+	Advice advice = Advice::NORMAL;
+	bool verify = false;
+	std::filesystem::path index;
+	size_t cache_size = 0;
+	uint64_t max_size = NSPRE_MAX_SIZE;
+	size_t max_count = NSPRE_MAX_COUNT;
+};
+
+struct CacheStats {
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	size_t bytes = 0;
+};
+
+// Totals for every Reader and Writer in the process since it started or reset_stats() was
+// called. Only collected when NSPRE_STATS is defined in the file with NSPRE_IMPL, otherwise the
+// counting compiles away and every total stays 0.
+struct Stats {
+	uint64_t reads = 0;              // Reads from archives and source files. Mapped archives make none.
+	uint64_t bytes_read = 0;
+	uint64_t literals = 0;           // Literal bytes decoded or encoded.
+	uint64_t matches = 0;            // Ring buffer lookups decoded or encoded.
+	uint64_t match_lengths[16]{};    // Lookups of each length from 3 to 18.
+	uint64_t opens = 0;              // Reader::construct calls and their wall time.
+	uint64_t open_ns = 0;
+	uint64_t extracts = 0;           // Subfile::extract calls and their wall time.
+	uint64_t extract_ns = 0;
+	uint64_t writes = 0;             // Subfiles written and their wall time.
+	uint64_t write_ns = 0;
+	std::string report(bool json = false) const;
+};
+
+Stats stats();
+void reset_stats();
+
+struct DecoderCheckpoints;
+
+// A read only file that any number of threads can read from at once. Every read gives its own
+// offset so there is no shared file position.
+class InputFile {
+#ifdef NSPRE_POSIX
+	int m_fd = -1;
+#else
+	std::ifstream m_stream;
+	std::mutex m_mutex;
+#endif
+public:
+	InputFile() {}
+	InputFile(const InputFile&) = delete;
+	InputFile& operator=(const InputFile&) = delete;
+	~InputFile();
+	bool open(const std::filesystem::path& path);
+	void close();
+	bool is_open() const;
+	bool read(uint64_t offset, char* buffer, size_t size);
+	size_t read_some(uint64_t offset, char* buffer, size_t size);
+	void advise(uint64_t offset, uint64_t size, Advice advice);
+	int fd() const;
+};
+
 class Reader {
 public:
-	typedef std::function<int (char*,size_t)> Outfunc;
-	class Subfile : public SubfileBase {
-		std::ifstream& stream;
-		char m_subheader[16];
-		int m_cmp_size;
-		int m_size;
-		int m_offset;
-		int extract(Outfunc& outfunc);
+	typedef std::function<int (const char*,size_t)> Outfunc;
+	// A handle to one entry in the Reader's index. Everything about the subfile is looked up from
+	// the Reader, which has to stay open for as long as the handle is used.
+	class Subfile {
+		Reader* m_reader;
+		size_t m_index;
+		std::shared_ptr<DecoderCheckpoints> checkpoints();
+		const char* mapped_data() const;
 	public:
-		Subfile(std::ifstream& i_stream, const char* i_subheader, const std::string& i_prepath, int i_offset);
+		Subfile(Reader& i_reader, size_t i_index) : m_reader(&i_reader), m_index(i_index) {}
+		std::string_view prepath() const;
+		std::string_view raw_path() const;
+		std::string_view filename() const;
 		int cmp_size() const;
 		int size() const;
 		int offset() const;
-		std::vector<char> subheader(); 
+		unsigned int crc() const;
+		std::vector<char> subheader() const;
+		const char* data() const;
+#ifdef __cpp_lib_span
+		std::span<const char> view() const;
+#endif
+		void prefetch() const;
+		bool verify_path() const;
+		int checksum(unsigned int& crc_out);
+		int raw_size() const;
+		int extract_raw(const Outfunc& outfunc) const;
+		int extract_raw(std::vector<char>& data_out) const;
+		template <typename Sink, std::enable_if_t<std::is_invocable_r_v<int, Sink&, const char*, size_t>, int> = 0>
+		int extract(Sink&& sink);
+		int extract(const Outfunc& outfunc);
+		int extract_range(size_t offset, size_t length, const Outfunc& outfunc);
+		int extract_range(size_t offset, size_t length, std::vector<char>& data_out);
 		int extract(char* data_out);
 		int extract(std::vector<char>& data_out);
 		int extract(const std::filesystem::path& path);
 	};
+	typedef std::shared_ptr<const std::vector<char>> SharedBuffer;
 private:
-	std::ifstream stream;
+	// Decompressed Subfiles by index, least recently used at the back of order.
+	struct Cache {
+		std::mutex mutex;
+		size_t budget = 0;
+		std::list<size_t> order;
+		std::vector<std::pair<SharedBuffer, std::list<size_t>::iterator>> entries;
+		CacheStats stats;
+	};
+
+	// Fields of every subfile as parallel arrays, then m_slots slots of the find() hash table,
+	// then every stored path one after another. Path sizes are multiples of 4 so the paths fill
+	// whole words. Built with one allocation when the paths average under PATH_ESTIMATE bytes.
+	enum Field { SIZE, CMP_SIZE, OFFSET, CRC, PATH, FIELD_COUNT };
+	static constexpr size_t PATH_ESTIMATE = 64;
+	static constexpr uint32_t EMPTY_SLOT = 0xffffffff;
+	std::vector<uint32_t> m_table;
+	size_t m_count = 0;
+	size_t m_slots = 0;
+
+	InputFile m_file;
+	std::filesystem::path m_path;
 	std::vector<Subfile> m_files;
+	// Subfiles whose stored checksum isn't of their path, in order. Listed by the first find().
+	std::vector<int> m_unkeyed;
+	std::atomic<bool> m_unkeyed_ready{false};
+	std::mutex m_unkeyed_mutex;
+	std::vector<std::shared_ptr<DecoderCheckpoints>> m_checkpoints;
+	std::mutex m_checkpoints_mutex;
+	char* m_map = nullptr;
+	size_t m_map_size = 0;
 	char m_header[12];
 	int m_size;
 	int m_error = Error::UNINITIALIZED;
-	void construct(const std::filesystem::path& path);
+	std::unique_ptr<Cache> m_cache;
+	// The range of the file prefetch() last asked the system to read.
+	std::mutex m_prefetch_mutex;
+	uint64_t m_prefetch_start = 0;
+	uint64_t m_prefetch_end = 0;
+	void construct(const std::filesystem::path& path, const ReaderOptions& options);
+	int scan(const ReaderOptions& options);
+	void begin_table(size_t count);
+	void add_to_table(size_t i, const char* subheader, uint32_t offset, const char* path);
+	uint32_t field(Field f, size_t i) const;
+	size_t paths_start() const;
+	bool load_index(const std::filesystem::path& index, const ReaderOptions& options);
+	const char* mapped(int offset, int size) const;
+	void build_index();
+	void list_unkeyed();
+	int map(const ReaderOptions& options);
+	void unmap();
 public:
 	Reader(){};
-	Reader(const std::filesystem::path& path);
-	int open(const std::filesystem::path& path);
+	Reader(const std::filesystem::path& path, const ReaderOptions& options = ReaderOptions());
+	~Reader();
+	int open(const std::filesystem::path& path, const ReaderOptions& options = ReaderOptions());
 	void close();
 	std::vector<Subfile>& files();
+	Subfile* find(std::string_view prepath);
+	int verify(const std::filesystem::path& checksums = std::filesystem::path());
+	int save_index(const std::filesystem::path& index);
+	void prefetch(size_t index, size_t bytes);
+	int extract(size_t index, SharedBuffer& data_out);
+	CacheStats cache_stats();
+	void clear_cache();
 	int size();
 	std::vector<char> header();
 	int error();
@@ -120,8 +329,378 @@ struct Subfile : public SubfileBase {
 	Subfile(const std::filesystem::path& i_source, const std::string& i_prepath);
 };
 
-int write(Subfile* subfiles, size_t count, const std::filesystem::path& path);
-int write(std::vector<Subfile>& subfiles, const std::filesystem::path& path);
+struct WriterOptions {
+	bool compress = false;
+	int level = 3;
+	unsigned int threads = 1;
+	uint64_t max_size = NSPRE_MAX_SIZE;
+	size_t max_count = NSPRE_MAX_COUNT;
+};
+
+class WriteTarget;
+
+class Writer {
+	struct Entry {
+		std::string prepath;
+		std::filesystem::path source;
+		const char* data = nullptr;
+		size_t size = 0;
+		std::vector<char> buffer;
+		Reader::Subfile* subfile = nullptr;
+		bool raw = false;
+		char sizes[8]{};
+	};
+
+	// How write_entry() treats a subfile. TRY_COMPRESS writes nothing at all if the subfile would
+	// be stored, leaving the caller to write it with STORE.
+	enum Mode { STORE, COMPRESS, TRY_COMPRESS };
+
+	WriterOptions m_options;
+	std::vector<Entry> m_entries;
+	int write_entry(WriteTarget& out, const Entry& entry, Mode mode) const;
+	int write_raw(WriteTarget& out, const Entry& entry) const;
+	int write_parallel(WriteTarget& out, const std::vector<const Entry*>& entries, unsigned int threads) const;
+	bool too_large(WriteTarget& out) const;
+	int write(WriteTarget& out, const std::vector<const Entry*>& entries) const;
+	int write(WriteTarget& out) const;
+	int write(const std::filesystem::path& path, const std::vector<const Entry*>& entries) const;
+public:
+	Writer(const WriterOptions& options = WriterOptions()) : m_options(options) {}
+	void add(const std::filesystem::path& source, const std::string& prepath);
+	void add(Subfile& subfile);
+	void add(Reader::Subfile& subfile);
+	void add(Reader::Subfile& subfile, const std::string& prepath);
+	void add(Reader& reader);
+	void add_raw(const char* subheader, const char* data, const std::string& prepath);
+	void add_raw(const char* subheader, std::vector<char>&& data, const std::string& prepath);
+	void add(const char* data, size_t size, const std::string& prepath);
+	void add(std::vector<char>&& data, const std::string& prepath);
+#ifdef __cpp_lib_span
+	void add(std::span<const char> data, const std::string& prepath);
+#endif
+	size_t count() const;
+	void clear();
+	int write(const std::filesystem::path& path) const;
+	int write(std::vector<char>& data_out) const;
+	int update(const std::filesystem::path& path, const std::vector<std::string>& remove = std::vector<std::string>()) const;
+};
+
+int write(Subfile* subfiles, size_t count, const std::filesystem::path& path, const WriterOptions& options = WriterOptions());
+int write(std::vector<Subfile>& subfiles, const std::filesystem::path& path, const WriterOptions& options = WriterOptions());
+
+// Everything from here to NSPRE_IMPL is used by Reader::Subfile::extract(Sink&&), which as a
+// template has to be defined in every file that includes the library.
+
+#ifndef NSPRE_CHUNK_SIZE
+#define NSPRE_CHUNK_SIZE 262144
+#endif
+
+namespace detail
+{
+
+// Nothing here changes with NSPRE_STATS, so files built with and without it agree on every
+// definition. Whether the templates count is decided by the StatTimer they start with, whose
+// constructor and destructor are defined in the file with NSPRE_IMPL. Those two calls are all
+// that's left of the counting without NSPRE_STATS. The decoder is instantiated both ways so the
+// check is made once per call rather than in the loop.
+
+// Literal and lookup counts for one run of the encoder or decoder, kept separately so the hot
+// loops don't touch shared atomics. add_stats() folds them into the totals.
+struct TokenCounts {
+	uint64_t literals = 0;
+	uint64_t matches = 0;
+	uint64_t match_lengths[16]{};
+
+	void literal() { ++literals; }
+	void match(unsigned int length) { ++matches; ++match_lengths[length - 3]; }
+};
+
+// Stands in for TokenCounts when nothing is being counted.
+struct NoCounts {
+	void literal() {}
+	void match(unsigned int) {}
+};
+
+void add_stats(const TokenCounts& counts);
+inline void add_stats(const NoCounts&) {}
+
+// Adds its lifetime to a phase's wall time when it goes out of scope. Does nothing without
+// NSPRE_STATS.
+struct StatTimer {
+	enum Phase { OPEN, EXTRACT, WRITE };
+	Phase phase;
+	bool counting;   // Whether NSPRE_STATS was defined in the file with NSPRE_IMPL.
+	std::chrono::steady_clock::time_point start;
+
+	StatTimer(Phase i_phase);
+	~StatTimer();
+};
+
+// Compressed subfiles in a prefile are made up of structures consisting of a
+// "type byte" followed by a combination of 8 "literal bytes" and "ring buffer lookups".
+
+// type byte:          1 byte
+// literal byte:       1 byte
+// ring buffer lookup: 2 bytes
+
+// Layout:
+//     tb = type byte
+//     x = literal byte or ring buffer lookup
+//     total size: 9-17 bytes
+//     [[tb][x][x][x][x][x][x][x][x]]
+
+// The 8 bits of a type byte indicate the mix of literal bytes and ring buffer lookups to
+// follow. The byte is read from least to most significant bit. A 1 indicates a literal
+// byte and a 0 indicates a ring buffer lookup.
+
+// Example:
+//     type byte: 00011111
+//     5 literal bytes followed by 3 ring buffer lookups.
+//     total size: 12 bytes (1 + (5 * 1) + (3 * 2))
+
+// The ring buffer is 4096 bytes and is written to starting at offset 4078. Once you reach the
+// end of the buffer, you start writing at offset 0. Files larger than 4 KiB will overwrite
+// previous data, providing a view of at most the last 4 KiB of the file.
+
+// All bytes written to the output file are also written to the ring buffer.
+
+// A ring buffer lookup is 2 bytes and provides 2 values, the offset and the length.
+// offset: A 12 bit value indicating where to begin copying from the ring buffer.
+// length: A 4 bit value indicating how many bytes to copy from the ring buffer.
+
+// Layout:
+//     [byte 0] [byte 1]
+//     aaaaaaaa bbbbcccc
+//     offset: bbbbaaaaaaaa
+//     length:         cccc
+
+// The length has 3 added to it resulting in a range of 3-18 instead of 0-15.
+
+// The decoder doesn't keep a separate ring buffer. Every byte written to the ring buffer is
+// also written to the output, so a lookup can be turned into a distance back from the current
+// output position and copied straight out of the output. Lookups that reach back before the
+// start of the file read the initial contents of the ring buffer, which are zeros.
+
+// Decoding can stop and resume between any two bytes of input or output, so the caller can
+// feed in the compressed data and drain the output in whatever sized pieces suit it.
+struct Decoder {
+	size_t total = 0;             // Bytes decoded so far.
+	unsigned int flags = 0;       // Unused type byte bits above a marker bit. <= 1 when a new type byte is needed.
+	unsigned int match_dist = 0;  // Distance back to copy the rest of an unfinished lookup from.
+	unsigned int match_left = 0;  // Bytes left to copy for an unfinished lookup.
+
+	// Decode in[in_pos, in_size) to out[out_pos, out_size), stopping when the output is full or
+	// the next literal or lookup isn't completely within the input. The bytes before out_pos
+	// must be the last min(total, 4096) bytes decoded.
+	template <bool Stats>
+	void decode(const char* in, size_t& in_pos, size_t in_size, char* out, size_t& out_pos, size_t out_size) {
+		std::conditional_t<Stats, TokenCounts, NoCounts> counts;
+		decode(in, in_pos, in_size, out, out_pos, out_size, counts);
+		add_stats(counts);
+	}
+
+	template <typename Counts>
+	void decode(const char* in, size_t& in_pos, size_t in_size, char* out, size_t& out_pos, size_t out_size, Counts& counts) {
+		for (;;) {
+			if (match_left) {
+				size_t count = std::min<size_t>(match_left, out_size - out_pos);
+
+				if (match_dist <= total && match_dist >= count) {
+					std::memcpy(out + out_pos, out + out_pos - match_dist, count);
+				}
+				else {
+					// Overlapping or reaching back before the start of the file.
+					for (size_t i = 0; i < count; ++i) {
+						out[out_pos + i] = match_dist > total + i ? 0 : out[out_pos + i - match_dist];
+					}
+				}
+
+				out_pos += count;
+				total += count;
+				match_left -= count;
+				if (match_left) return;
+			}
+
+			if (flags <= 1) {
+				if (in_pos >= in_size) return;
+				flags = static_cast<unsigned char>(in[in_pos++]) | 0x100;
+			}
+
+			if (flags & 1) {
+				if (in_pos >= in_size || out_pos >= out_size) return;
+				out[out_pos++] = in[in_pos++];
+				++total;
+				counts.literal();
+			}
+			else {
+				if (in_size - in_pos < 2) return;
+
+				unsigned int offset, count;
+
+				offset = static_cast<unsigned char>(in[in_pos]);
+				offset |= ((static_cast<unsigned char>(in[in_pos + 1]) & 0xf0) << 4);
+				count = (static_cast<unsigned char>(in[in_pos + 1]) & 0xf) + 3;
+				in_pos += 2;
+
+				unsigned int rb_pos = (4078 + total) % 4096;
+				match_dist = (rb_pos - offset) % 4096;
+				if (match_dist == 0) match_dist = 4096;
+				match_left = count;
+				counts.match(count);
+			}
+
+			flags >>= 1;
+		}
+	}
+};
+
+// Reads a compressed payload in large windows for the decoder. Bytes the decoder couldn't use
+// yet are moved to the front of the buffer before reading more. When the payload is already in
+// memory it's handed to the decoder as one window.
+struct InputWindow {
+	InputFile& file;
+	uint64_t offset;
+	std::vector<char> buffer;
+	const char* data;
+	size_t pos = 0;
+	size_t size = 0;
+	size_t remaining = 0;
+	size_t total_size;
+
+	InputWindow(InputFile& i_file, uint64_t i_offset, const char* mapped, size_t i_size) :
+		file(i_file),
+		offset(i_offset),
+		data(mapped),
+		total_size(i_size)
+	{
+		if (mapped) {
+			size = i_size;
+		}
+		else {
+			buffer.resize(std::min<size_t>(i_size, NSPRE_CHUNK_SIZE));
+			data = buffer.data();
+			remaining = i_size;
+		}
+	}
+
+	// Read more input if the decoder could have stopped for lack of it.
+	int fill() {
+		size_t left = size - pos;
+		if (!remaining || left >= 2) return Error::NO_ERROR;
+
+		std::memmove(buffer.data(), buffer.data() + pos, left);
+		size_t count = std::min(remaining, buffer.size() - left);
+		if (!file.read(offset, buffer.data() + left, count)) {
+			return Error::READ_SUBFILE;
+		}
+
+		offset += count;
+		pos = 0;
+		size = left + count;
+		remaining -= count;
+		return Error::NO_ERROR;
+	}
+
+	bool done() const {
+		return !remaining && pos == size;
+	}
+
+	// Bytes of the payload the decoder has used so far.
+	size_t consumed() const {
+		return total_size - remaining - (size - pos);
+	}
+};
+
+}
+
+// Output is passed to sink in pieces of up to NSPRE_CHUNK_SIZE bytes. Sink is anything callable
+// as int(const char* data, size_t size) that returns 0 to continue, or an error code to stop
+// and have extract return it. Unlike an Outfunc, calls to it can be inlined.
+template <typename Sink, std::enable_if_t<std::is_invocable_r_v<int, Sink&, const char*, size_t>, int>>
+int Reader::Subfile::extract(Sink&& sink) {
+	detail::StatTimer timer(detail::StatTimer::EXTRACT);
+	if (!m_reader->m_file.is_open()) {
+		return Error::UNINITIALIZED;
+	}
+
+	const char* data = mapped_data();
+
+	// If cmp_size is 0 the file is uncompressed and can just be copied.
+	if (cmp_size() == 0) {
+		if (data) {
+			for (int pos = 0; pos < size(); pos += NSPRE_CHUNK_SIZE) {
+				if (int err = sink(data + pos, std::min(size() - pos, NSPRE_CHUNK_SIZE))) {
+					return err;
+				}
+			}
+
+			return Error::NO_ERROR;
+		}
+
+		std::vector<char> buffer(std::min(size(), NSPRE_CHUNK_SIZE));
+		int bytes = size();
+		uint64_t pos = offset();
+
+		while (bytes > 0) {
+			int count = std::min(bytes, NSPRE_CHUNK_SIZE);
+			if (!m_reader->m_file.read(pos, buffer.data(), count)) {
+				return Error::READ_SUBFILE;
+			}
+
+			if (int err = sink(buffer.data(), count)) {
+				return err;
+			}
+
+			pos += count;
+			bytes -= count;
+		}
+
+		return Error::NO_ERROR;
+	}
+
+	// Output is decoded into a buffer that keeps the last 4096 bytes in front of each new chunk
+	// for lookups to copy from.
+	detail::Decoder decoder;
+	detail::InputWindow in(m_reader->m_file, offset(), data, cmp_size());
+	std::vector<char> out(4096 + NSPRE_CHUNK_SIZE);
+	size_t out_pos = 4096;
+	for (;;) {
+		if (int err = in.fill()) {
+			return err;
+		}
+
+		if (timer.counting) {
+			decoder.decode<true>(in.data, in.pos, in.size, out.data(), out_pos, out.size());
+		}
+		else {
+			decoder.decode<false>(in.data, in.pos, in.size, out.data(), out_pos, out.size());
+		}
+
+		bool finished = in.done() && !decoder.match_left;
+		if (out_pos == out.size() || finished) {
+			if (out_pos > 4096) {
+				if (int err = sink(out.data() + 4096, out_pos - 4096)) {
+					return err;
+				}
+			}
+
+			std::memmove(out.data(), out.data() + out_pos - 4096, 4096);
+			out_pos = 4096;
+		}
+		else if (!in.remaining) {
+			// Stopped partway through a lookup at the end of the input.
+			return Error::DECODE_SUBFILE;
+		}
+
+		if (finished) break;
+	}
+
+	if (decoder.total != static_cast<size_t>(size())) {
+		return Error::DECODE_SUBFILE;
+	}
+
+	return Error::NO_ERROR;
+}
 
 #ifdef NSPRE_IMPL
 std::string SubfileBase::filename() const {
@@ -173,474 +752,1983 @@ void Write32LE(char* buffer, T in) {
 	buffer[3] = static_cast<char>((in >> 24) & 0xff);
 }
 
-std::vector<Reader::Subfile>& Reader::files() {
-	return m_files;
+inline uint64_t Read64LE(const char* buffer) {
+	return static_cast<uint64_t>(Read32LE<uint32_t>(buffer)) | (static_cast<uint64_t>(Read32LE<uint32_t>(buffer + 4)) << 32);
 }
 
-int Reader::size() {
-	return m_size;
+inline void Write64LE(char* buffer, uint64_t in) {
+	Write32LE<uint64_t>(buffer, in & 0xffffffff);
+	Write32LE<uint64_t>(buffer + 4, in >> 32);
 }
 
-std::vector<char> Reader::header() {
-	std::vector<char> v(12);
-	std::copy(m_header, m_header + 12, v.begin());
-	return v;
-}
+static constexpr unsigned int crc_table[] =
+{
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
+	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
+	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
+	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
+	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
+	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
+	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
+	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
+	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
+	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
+	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
+	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
+	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
+	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
+	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
+	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
+	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
+	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
 
-int Reader::error() {
-	return m_error;
-}
+static const unsigned int CRC_START = 0xffffffff;
 
-int Reader::open(const std::filesystem::path& path) {
-	if (stream.is_open() || !m_error) {
-		return Error::ALREADY_OPEN;
+// Tables for processing 8 bytes at a time (slicing-by-8). crc_slices.table[k][b] is the CRC
+// of byte b followed by k zero bytes.
+struct CrcSlices
+{
+	unsigned int table[8][256];
+
+	constexpr CrcSlices() : table()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			table[0][i] = crc_table[i];
+		}
+
+		for (int k = 1; k < 8; ++k)
+		{
+			for (int i = 0; i < 256; ++i)
+			{
+				table[k][i] = (table[k - 1][i] >> 8) ^ crc_table[table[k - 1][i] & 0xff];
+			}
+		}
 	}
+};
 
-	construct(path);
-	return m_error;
-}
+static constexpr CrcSlices crc_slices;
 
-void Reader::close() {
-	if (stream.is_open()) {
-		stream.close();
+static unsigned int crc_update_slice8(unsigned int crc, const char *buffer, size_t size)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(buffer);
+	const auto& t = crc_slices.table;
+
+	while (size >= 8)
+	{
+		unsigned int lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24));
+		unsigned int hi = p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<unsigned int>(p[7]) << 24);
+
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+		p += 8;
+		size -= 8;
 	}
 
-	m_files.clear();
-	std::memset(m_header, 0, 12);
-	m_size = 0;
-	m_error = Error::UNINITIALIZED;
-}
+	while (size--)
+	{
+		crc = crc_table[static_cast<unsigned char>(crc) ^ *p++] ^ (crc >> 8);
+	}
 
-Reader::Reader(const std::filesystem::path& path) {
-	construct(path);
+	return crc;
 }
 
-void Reader::construct(const std::filesystem::path& path) {
-	stream.open(path, std::ios::binary);
-	if (stream.fail()) {
-		m_error = Error::FILE_OPEN;
-		return;
+#ifdef NSPRE_CRC_CLMUL
+// Carry-less multiplication folding, from Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction". The SSE4.2 crc32 instruction can't be used, it computes CRC-32C
+// which has a different polynomial. size must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int crc_update_clmul(unsigned int crc, const char *buffer, size_t size)
+{
+	alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+	const __m128i *p = reinterpret_cast<const __m128i*>(buffer);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	// Fold 64 bytes at a time in 4 lanes.
+	x1 = _mm_loadu_si128(p + 0);
+	x2 = _mm_loadu_si128(p + 1);
+	x3 = _mm_loadu_si128(p + 2);
+	x4 = _mm_loadu_si128(p + 3);
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+	p += 4;
+	size -= 64;
+
+	while (size >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(p + 0));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(p + 1));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(p + 2));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(p + 3));
+
+		p += 4;
+		size -= 64;
 	}
 
-	stream.read(m_header, 12);
-	if (stream.fail()) {
-		m_error = Error::READ_HEADER;
-		return;
-	}
+	// Fold the 4 lanes into one.
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
 
-	// Pre file header layout:
-	// Size Description
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
 
-	// 4    Total file size
-	// 2    Version?
-	// 2    Unknown
-	// 4    Number of subfiles
-	
-	m_size = Read32LE<int>(m_header);
-	int count = Read32LE<int>(m_header + 8);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
 
-	if (m_size < NSPRE_MIN_SIZE || m_size > NSPRE_MAX_SIZE || count > NSPRE_MAX_COUNT) {
-		m_error = Error::BAD_FILE;
-		return;
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Fold the remaining 16 byte blocks.
+	while (size >= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(p)), x5);
+
+		++p;
+		size -= 16;
 	}
 
-	for (int i = 0; i < count; ++i) {
-		char subheader[16];
-		stream.read(subheader, 16);
-		if (stream.fail()) {
-			m_error = Error::READ_SUBHEADER;
-			return;
-		}
+	// Fold 128 bits down to 64.
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
 
-		// Subfile header layout:
-		// Size Description
+	x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
 
-		// 4    Uncompressed file size
-		// 4    Compressed file size
-		// 4    Path string size
-		// 4    Path string checksum
-		// n    Path string (size is a multiple of 4)
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
 
-		int path_size = Read32LE<int>(&subheader[8]); // Path string length is always a multiple of 4 bytes.
+	// Barrett reduction to 32 bits.
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
 
-		if (path_size < 4 || path_size > NSPRE_PATH_MAX) {
-			m_error = Error::BAD_FILE;
-			return;
-		}
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
 
-		std::vector<char> path_bytes(path_size);
-		stream.read(&path_bytes[0], path_size);
-		if (stream.fail()) {
-			m_error = Error::READ_SUBPATH;
-			return;
-		}
+	return _mm_extract_epi32(x1, 1);
+}
 
-		std::string prepath(path_bytes.begin(), path_bytes.end());
-		Subfile subfile(stream, subheader, prepath, stream.tellg());
-		m_files.push_back(subfile);
+static bool crc_has_clmul()
+{
+	static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+	return supported;
+}
+#endif
 
-		int file_size = subfile.cmp_size() ? subfile.cmp_size() : subfile.size(); // If the compressed size is 0 the file is uncompressed.
-		int padding = (file_size % 4) ? 4 - (file_size % 4) : 0; // Files that are not a multiple of 4 bytes in size have padding at the end to maintain alignment.
-		stream.ignore(file_size + padding);
+// Continue a CRC over more data. Uses carry-less multiplication when the CPU supports it and
+// slicing-by-8 otherwise. Both give the same result as going through crc_table a byte at a time.
+static unsigned int crc_update(unsigned int crc, const char *buffer, size_t size)
+{
+#ifdef NSPRE_CRC_CLMUL
+	if (size >= 64 && crc_has_clmul())
+	{
+		size_t count = size & ~static_cast<size_t>(15);
+		crc = crc_update_clmul(crc, buffer, count);
+		buffer += count;
+		size -= count;
 	}
+#endif
 
-	m_error = 0;
+	return crc_update_slice8(crc, buffer, size);
 }
 
-int Reader::Subfile::cmp_size() const {
-	return m_cmp_size;
+static unsigned int string_crc(std::string_view str)
+{
+	return crc_update(CRC_START, str.data(), str.size());
 }
 
-int Reader::Subfile::size() const {
-	return m_size;
+static unsigned int buffer_crc(const char *buffer, size_t size)
+{
+	return crc_update(CRC_START, buffer, size);
 }
 
-int Reader::Subfile::offset() const {
-	return m_offset;
-}
+#ifdef NSPRE_STATS
+struct StatCounters {
+	std::atomic<uint64_t> reads{0};
+	std::atomic<uint64_t> bytes_read{0};
+	std::atomic<uint64_t> literals{0};
+	std::atomic<uint64_t> matches{0};
+	std::atomic<uint64_t> match_lengths[16]{};
+	std::atomic<uint64_t> opens{0};
+	std::atomic<uint64_t> open_ns{0};
+	std::atomic<uint64_t> extracts{0};
+	std::atomic<uint64_t> extract_ns{0};
+	std::atomic<uint64_t> writes{0};
+	std::atomic<uint64_t> write_ns{0};
+};
 
-std::vector<char> Reader::Subfile::subheader() {
-	std::vector<char> v;
-	std::copy(m_subheader, m_subheader + 16, v.begin());
-	return v;
-} 
+static StatCounters stat_counters;
+#endif
 
-Reader::Subfile::Subfile(std::ifstream& i_stream, const char* i_subheader, const std::string& i_prepath, int i_offset) :
-	SubfileBase(i_prepath),
-	stream(i_stream),
-	m_offset(i_offset) 
-{
-	m_size = Read32LE<int>(i_subheader);
-	m_cmp_size = Read32LE<int>(i_subheader + 4);
-	std::copy(i_subheader, i_subheader + 16, m_subheader);
+void detail::add_stats([[maybe_unused]] const TokenCounts& counts) {
+#ifdef NSPRE_STATS
+	stat_counters.literals += counts.literals;
+	stat_counters.matches += counts.matches;
+	for (int i = 0; i < 16; ++i) {
+		if (counts.match_lengths[i]) stat_counters.match_lengths[i] += counts.match_lengths[i];
+	}
+#endif
 }
 
-#ifndef NSPRE_CHUNK_SIZE
-#define NSPRE_CHUNK_SIZE 1024
+detail::StatTimer::StatTimer(Phase i_phase) : phase(i_phase), counting(NSPRE_STATS_ON) {
+#ifdef NSPRE_STATS
+	start = std::chrono::steady_clock::now();
 #endif
+}
 
-struct ExtractVars {
-	int in_pos = 0;
-	int rb_pos = 4078;
-	std::vector<char> ring_buffer;
+detail::StatTimer::~StatTimer() {
+#ifdef NSPRE_STATS
+	std::atomic<uint64_t>* counters[][2] = {
+		{ &stat_counters.opens, &stat_counters.open_ns },
+		{ &stat_counters.extracts, &stat_counters.extract_ns },
+		{ &stat_counters.writes, &stat_counters.write_ns }
+	};
 
-	ExtractVars() : ring_buffer(4096, 0) {}
-};
+	++*counters[phase][0];
+	*counters[phase][1] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+#endif
+}
 
-static int CopyByte(ExtractVars& vars, std::ifstream& stream, Reader::Outfunc& outfunc) {
-	char b;
-	stream.read(&b, 1);
-	if (stream.fail()) {
-		return Error::READ_SUBFILE;
+Stats stats() {
+	Stats out;
+#ifdef NSPRE_STATS
+	out.reads = stat_counters.reads;
+	out.bytes_read = stat_counters.bytes_read;
+	out.literals = stat_counters.literals;
+	out.matches = stat_counters.matches;
+	for (int i = 0; i < 16; ++i) {
+		out.match_lengths[i] = stat_counters.match_lengths[i];
 	}
+	out.opens = stat_counters.opens;
+	out.open_ns = stat_counters.open_ns;
+	out.extracts = stat_counters.extracts;
+	out.extract_ns = stat_counters.extract_ns;
+	out.writes = stat_counters.writes;
+	out.write_ns = stat_counters.write_ns;
+#endif
+	return out;
+}
 
-	if (int err = outfunc(&b, 1)) {
-		return err;
+void reset_stats() {
+#ifdef NSPRE_STATS
+	stat_counters.reads = 0;
+	stat_counters.bytes_read = 0;
+	stat_counters.literals = 0;
+	stat_counters.matches = 0;
+	for (int i = 0; i < 16; ++i) {
+		stat_counters.match_lengths[i] = 0;
 	}
+	stat_counters.opens = 0;
+	stat_counters.open_ns = 0;
+	stat_counters.extracts = 0;
+	stat_counters.extract_ns = 0;
+	stat_counters.writes = 0;
+	stat_counters.write_ns = 0;
+#endif
+}
 
-	vars.ring_buffer[vars.rb_pos] = b;
-	++vars.in_pos;
-	vars.rb_pos = (vars.rb_pos + 1) % 4096;
+// Phase times are summed over threads, so with several threads they can add up to more than the
+// time the program took.
+std::string Stats::report(bool json) const {
+	std::string out;
+	char line[256];
+	auto append = [&](const char* format, auto... args) {
+		std::snprintf(line, sizeof(line), format, args...);
+		out += line;
+	};
 
-	return Error::NO_ERROR;
-}
+	auto ms = [](uint64_t ns) { return ns / 1e6; };
 
-static int CopyRB(ExtractVars& vars, std::ifstream& stream, Reader::Outfunc& outfunc) {
-	char dict[2];
-	stream.read(dict, 2);
-	if (stream.fail()) {
-		return Error::READ_SUBFILE;
+	if (json) {
+		append("{\"reads\":%ju,\"bytes_read\":%ju,\"literals\":%ju,\"matches\":%ju,\"match_lengths\":[",
+			uintmax_t(reads), uintmax_t(bytes_read), uintmax_t(literals), uintmax_t(matches));
+		for (int i = 0; i < 16; ++i) {
+			append(i ? ",%ju" : "%ju", uintmax_t(match_lengths[i]));
+		}
+		append("],\"open\":{\"calls\":%ju,\"ms\":%.3f}", uintmax_t(opens), ms(open_ns));
+		append(",\"extract\":{\"calls\":%ju,\"ms\":%.3f}", uintmax_t(extracts), ms(extract_ns));
+		append(",\"write\":{\"calls\":%ju,\"ms\":%.3f}}\n", uintmax_t(writes), ms(write_ns));
+		return out;
 	}
 
-	vars.in_pos += 2;
-
-	unsigned int offset, count;
+	append("reads: %ju\nbytes read: %ju\n", uintmax_t(reads), uintmax_t(bytes_read));
+	append("literals: %ju\nmatches: %ju\nmatch lengths:", uintmax_t(literals), uintmax_t(matches));
+	for (int i = 0; i < 16; ++i) {
+		append(" %d:%ju", i + 3, uintmax_t(match_lengths[i]));
+	}
+	append("\nopen: %ju calls, %.3f ms\n", uintmax_t(opens), ms(open_ns));
+	append("extract: %ju calls, %.3f ms\n", uintmax_t(extracts), ms(extract_ns));
+	append("write: %ju calls, %.3f ms\n", uintmax_t(writes), ms(write_ns));
+	return out;
+}
 
-	offset = static_cast<unsigned char>(dict[0]);
-	offset |= ((static_cast<unsigned char>(dict[1]) & 0xf0) << 4);
-	count = (static_cast<unsigned char>(dict[1]) & 0xf) + 3;
+InputFile::~InputFile() {
+	close();
+}
 
-	for (int i = 0; i < count; ++i) {
-		char b = vars.ring_buffer[(offset + i) % 4096];
-		vars.ring_buffer[vars.rb_pos] = b;
-		vars.rb_pos = (vars.rb_pos + 1) % 4096;
+#ifdef NSPRE_POSIX
+bool InputFile::open(const std::filesystem::path& path) {
+	m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	return m_fd >= 0;
+}
 
-		if (int err = outfunc(&b, 1)) {
-			return err;
-		}
+void InputFile::close() {
+	if (m_fd >= 0) {
+		::close(m_fd);
 	}
 
-	return Error::NO_ERROR;
+	m_fd = -1;
 }
 
-int Reader::Subfile::extract(Outfunc& outfunc) {
-	if (!stream.is_open()) {
-		return Error::UNINITIALIZED;
-	}
+bool InputFile::is_open() const {
+	return m_fd >= 0;
+}
 
-	stream.seekg(m_offset);
-	if (stream.fail()) {
-		std::fprintf(stderr,"seek fail\n");
-		return Error::READ_SUBFILE;
+bool InputFile::read(uint64_t offset, char* buffer, size_t size) {
+	while (size > 0) {
+		ssize_t count = pread(m_fd, buffer, size, offset);
+		NSPRE_STAT(++stat_counters.reads);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		NSPRE_STAT(stat_counters.bytes_read += count);
+
+		buffer += count;
+		offset += count;
+		size -= count;
 	}
 
-	// If cmp_size is 0 the file is uncompressed and can just be copied.
-	if (m_cmp_size == 0) {
-		std::vector<char> buffer(NSPRE_CHUNK_SIZE);
-		int bytes = m_size;
-		
-		while (bytes > 0) {
-			if (bytes >= NSPRE_CHUNK_SIZE) {
-				stream.read(buffer.data(), NSPRE_CHUNK_SIZE);
-				if (stream.fail()) {
-					return Error::READ_SUBFILE;
-				}
+	return true;
+}
 
-				if (int err = outfunc(buffer.data(), NSPRE_CHUNK_SIZE)) {
-					return err;
-				}
+// Like read but stops early at the end of the file. Returns the number of bytes read.
+size_t InputFile::read_some(uint64_t offset, char* buffer, size_t size) {
+	size_t total = 0;
+	while (total < size) {
+		ssize_t count = pread(m_fd, buffer + total, size - total, offset + total);
+		NSPRE_STAT(++stat_counters.reads);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) break;
+		NSPRE_STAT(stat_counters.bytes_read += count);
+
+		total += count;
+	}
 
-				bytes -= NSPRE_CHUNK_SIZE;
-			}
-			else {
-				stream.read(buffer.data(), bytes);
-				if (stream.fail()) {
-					return Error::READ_SUBFILE;
-				}
+	return total;
+}
 
-				if (int err = outfunc(buffer.data(), bytes)) {
-					return err;
-				}
+// Tells the system how a range of the file will be read. WILLNEED starts reading it into the
+// page cache in the background. A size of 0 means to the end of the file.
+void InputFile::advise(uint64_t offset, uint64_t size, Advice advice) {
+#ifdef POSIX_FADV_WILLNEED
+	int flag = POSIX_FADV_NORMAL;
+	switch (advice) {
+	case Advice::SEQUENTIAL: flag = POSIX_FADV_SEQUENTIAL; break;
+	case Advice::RANDOM: flag = POSIX_FADV_RANDOM; break;
+	case Advice::WILLNEED: flag = POSIX_FADV_WILLNEED; break;
+	default: break;
+	}
 
-				break;
-			}
-		}
+	posix_fadvise(m_fd, offset, size, flag);
+#endif
+}
 
-		return Error::NO_ERROR;
+int InputFile::fd() const {
+	return m_fd;
+}
+#else
+// Without positional reads the stream has to be locked for each seek and read.
+bool InputFile::open(const std::filesystem::path& path) {
+	m_stream.open(path, std::ios::binary);
+	return !m_stream.fail();
 }
-	// Compressed subfiles in a prefile are made up of structures consisting of a
-	// "type byte" followed by a combination of 8 "literal bytes" and "ring buffer lookups".
-	
-	// type byte:          1 byte
-	// literal byte:       1 byte
-	// ring buffer lookup: 2 bytes
-	
-	// Layout:
-	//     tb = type byte
-	//     x = literal byte or ring buffer lookup
-	//     total size: 9-17 bytes
-	//     [[tb][x][x][x][x][x][x][x][x]]
-	
-	// The 8 bits of a type byte indicate the mix of literal bytes and ring buffer lookups to
-	// follow. The byte is read from least to most significant bit. A 1 indicates a literal
-	// byte and a 0 indicates a ring buffer lookup.
 
-	// Example:
-	//     type byte: 00011111
-	//     5 literal bytes followed by 3 ring buffer lookups.
-	//     total size: 12 bytes (1 + (5 * 1) + (3 * 2))
+void InputFile::close() {
+	if (m_stream.is_open()) {
+		m_stream.close();
+	}
+}
 
-	// The ring buffer is 4096 bytes and is written to starting at offset 4078. Once you reach the
-	// end of the buffer, you start writing at offset 0. Files larger than 4 KiB will overwrite
-	// previous data, providing a view of at most the last 4 KiB of the file.
+bool InputFile::is_open() const {
+	return m_stream.is_open();
+}
 
-	// All bytes written to the output file are also written to the ring buffer.
+bool InputFile::read(uint64_t offset, char* buffer, size_t size) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.clear();
+	m_stream.seekg(offset);
+	m_stream.read(buffer, size);
+	NSPRE_STAT(++stat_counters.reads);
+	NSPRE_STAT(stat_counters.bytes_read += m_stream.gcount());
+	return !m_stream.fail();
+}
 
-	// A ring buffer lookup is 2 bytes and provides 2 values, the offset and the length.
-	// offset: A 12 bit value indicating where to begin copying from the ring buffer.
-	// length: A 4 bit value indicating how many bytes to copy from the ring buffer.
+size_t InputFile::read_some(uint64_t offset, char* buffer, size_t size) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stream.clear();
+	m_stream.seekg(offset);
+	m_stream.read(buffer, size);
+	NSPRE_STAT(++stat_counters.reads);
+	NSPRE_STAT(stat_counters.bytes_read += m_stream.gcount());
+	return m_stream.gcount();
+}
 
-	// Layout:
-	//     [byte 0] [byte 1]
-	//     aaaaaaaa bbbbcccc
-	//     offset: bbbbaaaaaaaa
-	//     length:         cccc
+void InputFile::advise(uint64_t offset, uint64_t size, Advice advice) {
+}
 
-	// The length has 3 added to it resulting in a range of 3-18 instead of 0-15.
+int InputFile::fd() const {
+	return -1;
+}
+#endif
 
-	ExtractVars vars;
-	char type_byte = 0;
+std::vector<Reader::Subfile>& Reader::files() {
+	return m_files;
+}
 
-	while (vars.in_pos < m_cmp_size) {
-		stream.read(&type_byte, 1);
-		if (stream.fail()) {
-			return Error::READ_SUBFILE;
-		}
+int Reader::size() {
+	return m_size;
+}
 
-		++vars.in_pos;
+std::vector<char> Reader::header() {
+	std::vector<char> v(12);
+	std::copy(m_header, m_header + 12, v.begin());
+	return v;
+}
 
-		for (int i = 0; i < 8; ++i) {
-			if (static_cast<unsigned char>(type_byte) & (0x1 << i)) {
-				if (int err = CopyByte(vars, stream, outfunc)) {
-					return err;
-				}
-				if (vars.in_pos >= m_cmp_size) break;
-			}
-			else {
-				if (int err = CopyRB(vars, stream, outfunc)) {
-					return err;
-				}
-				if (vars.in_pos >= m_cmp_size) break;
-			}
-		}
+int Reader::error() {
+	return m_error;
+}
+
+int Reader::open(const std::filesystem::path& path, const ReaderOptions& options) {
+	if (m_file.is_open() || !m_error) {
+		return Error::ALREADY_OPEN;
 	}
 
-	return Error::NO_ERROR;
+	construct(path, options);
+	return m_error;
 }
 
-int Reader::Subfile::extract(char* data_out) {
-	size_t pos = 0;
-	Outfunc outfunc = [&data_out, &pos](char* data, size_t count) {
-		std::copy(data, data + count, data_out + pos);
-		pos += count;
-		return Error::NO_ERROR;
-	};
+void Reader::close() {
+	m_file.close();
+	m_path.clear();
 
-	return extract(outfunc);
+	unmap();
+	m_files.clear();
+	m_unkeyed.clear();
+	m_unkeyed_ready = false;
+	m_table = std::vector<uint32_t>();
+	m_count = 0;
+	m_slots = 0;
+	m_checkpoints.clear();
+	m_cache.reset();
+	m_prefetch_start = 0;
+	m_prefetch_end = 0;
+	std::memset(m_header, 0, 12);
+	m_size = 0;
+	m_error = Error::UNINITIALIZED;
 }
 
-int Reader::Subfile::extract(std::vector<char>& data_out) {
-	data_out.resize(m_size);
-	return extract(data_out.data());
+Reader::Reader(const std::filesystem::path& path, const ReaderOptions& options) {
+	construct(path, options);
 }
 
-int Reader::Subfile::extract(const std::filesystem::path& path) {
-	std::ofstream ostream(path, std::ios::binary);
-	if (ostream.fail()) {
-		return Error::FILE_OPEN_OUTPUT;
-	}
-
-	Outfunc outfunc = [&ostream](char* data, size_t count) {
-		ostream.write(data, count);
-		if (ostream.fail()) {
-			return Error::EXTRACT_SUBFILE;
-		}
-
-		return Error::NO_ERROR;
-	};
+Reader::~Reader() {
+	unmap();
+}
 
-	return extract(outfunc);
+#ifdef NSPRE_POSIX
+static int to_madvise(Advice advice) {
+	switch (advice) {
+	case Advice::SEQUENTIAL: return MADV_SEQUENTIAL;
+	case Advice::RANDOM: return MADV_RANDOM;
+	case Advice::WILLNEED: return MADV_WILLNEED;
+	default: return MADV_NORMAL;
+	}
 }
+#endif
 
-static const unsigned int crc_table[] =
-{
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
-	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
-	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
-	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
-	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
-	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
-	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
-	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
-	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
-	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
-	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
-	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
-	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
-	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
-	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
-	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
-	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
-	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
+// Map the whole file read only. Subfiles are then read straight out of the mapping instead of
+// through the stream.
+int Reader::map(const ReaderOptions& options) {
+#ifdef NSPRE_POSIX
+	struct stat st;
+	if (fstat(m_file.fd(), &st) != 0 || st.st_size <= 0) {
+		return Error::FILE_MAP;
+	}
 
-static const unsigned int CRC_START = 0xffffffff;
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, m_file.fd(), 0);
+	if (p == MAP_FAILED) {
+		return Error::FILE_MAP;
+	}
 
-static unsigned int string_crc(const std::string &str)
-{
-	unsigned int crc = CRC_START;
+	m_map = static_cast<char*>(p);
+	m_map_size = st.st_size;
 
-	for (char c : str)
-	{
-		unsigned int table_val = crc_table[static_cast<unsigned char>(crc) ^ static_cast<unsigned char>(c)];
-		crc = table_val ^ (crc >> 8);
+	if (options.advice != Advice::NORMAL) {
+		madvise(m_map, m_map_size, to_madvise(options.advice));
 	}
 
-	return crc;
+	return Error::NO_ERROR;
+#else
+	return Error::FILE_MAP;
+#endif
 }
 
-static unsigned int buffer_crc(const char *buffer, unsigned int size)
-{
-	unsigned int crc = CRC_START;
+void Reader::unmap() {
+#ifdef NSPRE_POSIX
+	if (m_map) {
+		munmap(m_map, m_map_size);
+	}
+#endif
+	m_map = nullptr;
+	m_map_size = 0;
+}
 
-	for (unsigned int i = 0; i < size; ++i)
-	{
-		unsigned int table_val = crc_table[static_cast<unsigned char>(crc) ^ static_cast<unsigned char>(buffer[i])];
-		crc = table_val ^ (crc >> 8);
+void Reader::construct(const std::filesystem::path& path, const ReaderOptions& options) {
+	NSPRE_STAT(detail::StatTimer timer(detail::StatTimer::OPEN));
+	if (!m_file.open(path)) {
+		m_error = Error::FILE_OPEN;
+		return;
 	}
 
-	return crc;
-}
+	m_path = path;
 
-static int write_subfile(std::ofstream& ostream, Subfile& subfile) {
-	std::ifstream stream(subfile.source, std::ios::binary);
-	if (stream.fail()) {
-		return Error::FILE_OPEN;
+	if (options.map) {
+		if (int err = map(options)) {
+			m_error = err;
+			return;
+		}
+	}
+	else if (options.advice != Advice::NORMAL) {
+		m_file.advise(0, 0, options.advice);
 	}
 
-	std::vector<char> file_buffer;
-	const size_t read_size = 1048576;
-	size_t total_count = 0;
-	size_t last_count = 0;
-	while (!stream.eof()) {
-		file_buffer.resize(total_count + read_size);
-		stream.read(file_buffer.data() + total_count, read_size);
-		last_count = stream.gcount();
-		total_count += last_count;
-		if (last_count < read_size) {
-			file_buffer.resize(total_count);
-			break;
+	bool loaded = !options.index.empty() && load_index(options.index, options);
+	if (!loaded) {
+		if (int err = scan(options)) {
+			m_error = err;
+			return;
 		}
 	}
 
-	std::vector<char> path_buffer(subfile.prepath().size());
-	std::copy(subfile.prepath().begin(), subfile.prepath().end(), path_buffer.begin());
+	m_files.reserve(m_count);
+	for (size_t i = 0; i < m_count; ++i) {
+		m_files.emplace_back(*this, i);
+	}
+
+	if (options.verify) {
+		for (const Subfile& subfile : m_files) {
+			if (!subfile.verify_path()) {
+				m_error = Error::BAD_CHECKSUM;
+				return;
+			}
+		}
+	}
+
+	build_index();
+
+	if (options.cache_size) {
+		m_cache = std::make_unique<Cache>();
+		m_cache->budget = options.cache_size;
+		m_cache->entries.resize(m_files.size());
+	}
+
+	m_error = 0;
+
+	// The index is only a cache so failing to write it doesn't fail the open.
+	if (!loaded && !options.index.empty()) {
+		save_index(options.index);
+	}
+}
+
+// Whether a header is within the limits in options. Every subfile takes at least 20 bytes of the
+// file, which also keeps a damaged count from sizing the table past what the file could hold.
+static bool within_limits(uint64_t size, int64_t count, const ReaderOptions& options) {
+	uint64_t max_size = std::min<uint64_t>(options.max_size, NSPRE_FORMAT_MAX_SIZE);
+	if (size < NSPRE_MIN_SIZE || size > max_size) {
+		return false;
+	}
+
+	return count <= 0 || (static_cast<uint64_t>(count) <= options.max_count && static_cast<uint64_t>(count) <= (size - 12) / 20);
+}
+
+// Reads the header and every subheader and path from the file.
+int Reader::scan(const ReaderOptions& options) {
+	// Subheaders and paths are spread out between the subfile contents. They're parsed from a
+	// window of the file so that subfiles smaller than the window don't each cost their own
+	// reads, and larger ones are skipped with a single read at the next subheader. A mapped file
+	// is parsed in place.
+	std::vector<char> window;
+	uint64_t window_pos = 0;
+	size_t window_size = 0;
+
+	auto view = [&](uint64_t pos, size_t size) -> const char* {
+		if (m_map) {
+			return pos + size <= m_map_size ? m_map + pos : nullptr;
+		}
+
+		if (pos < window_pos || pos + size > window_pos + window_size) {
+			if (window.empty()) {
+				window.resize(std::max<size_t>(NSPRE_INDEX_WINDOW, 12 + 16 + NSPRE_PATH_MAX));
+			}
+
+			window_pos = pos;
+			window_size = m_file.read_some(pos, window.data(), window.size());
+			if (window_size < size) {
+				return nullptr;
+			}
+		}
+
+		return window.data() + (pos - window_pos);
+	};
+
+	const char* header = view(0, 12);
+	if (!header) {
+		return Error::READ_HEADER;
+	}
+
+	std::memcpy(m_header, header, 12);
+
+	// Pre file header layout:
+	// Size Description
+
+	// 4    Total file size
+	// 2    Version?
+	// 2    Unknown
+	// 4    Number of subfiles
+	
+	uint64_t size = Read32LE<uint32_t>(m_header);
+	int count = Read32LE<int>(m_header + 8);
+
+	if (!within_limits(size, count, options)) {
+		return Error::BAD_FILE;
+	}
+
+	m_size = static_cast<int>(size);
+
+	begin_table(std::max(count, 0));
+	uint64_t pos = 12;
+
+	for (int i = 0; i < count; ++i) {
+		const char* subheader = view(pos, 16);
+		if (!subheader) {
+			return Error::READ_SUBHEADER;
+		}
+
+		pos += 16;
+
+		// Subfile header layout:
+		// Size Description
+
+		// 4    Uncompressed file size
+		// 4    Compressed file size
+		// 4    Path string size
+		// 4    Path string checksum
+		// n    Path string (size is a multiple of 4)
+
+		int path_size = Read32LE<int>(&subheader[8]); // Path string length is always a multiple of 4 bytes.
+
+		if (path_size < 4 || path_size > NSPRE_PATH_MAX) {
+			return Error::BAD_FILE;
+		}
+
+		// Copy the subheader out before the window can move.
+		char subheader_bytes[16];
+		std::memcpy(subheader_bytes, subheader, 16);
+
+		const char* path_bytes = view(pos, path_size);
+		if (!path_bytes) {
+			return Error::READ_SUBPATH;
+		}
+
+		// Anything past the format's limit can't be given as an int offset or size.
+		uint32_t file_size = Read32LE<uint32_t>(&subheader_bytes[4]) ? Read32LE<uint32_t>(&subheader_bytes[4]) : Read32LE<uint32_t>(&subheader_bytes[0]); // If the compressed size is 0 the file is uncompressed.
+		if (pos + path_size > NSPRE_FORMAT_MAX_SIZE ||
+			Read32LE<uint32_t>(&subheader_bytes[0]) > NSPRE_FORMAT_MAX_SIZE ||
+			Read32LE<uint32_t>(&subheader_bytes[4]) > NSPRE_FORMAT_MAX_SIZE) {
+			return Error::BAD_FILE;
+		}
+
+		add_to_table(i, subheader_bytes, static_cast<uint32_t>(pos + path_size), path_bytes);
+		pos += path_size;
+
+		uint32_t padding = (file_size % 4) ? 4 - (file_size % 4) : 0; // Files that are not a multiple of 4 bytes in size have padding at the end to maintain alignment.
+		pos += static_cast<uint64_t>(file_size) + padding;
+	}
+
+	return Error::NO_ERROR;
+}
+
+// Sizes the table for count subfiles and a hash table at most half full, with room for paths of
+// the usual length.
+void Reader::begin_table(size_t count) {
+	m_count = count;
+	m_slots = 1;
+	while (m_slots < count * 2) m_slots *= 2;
+
+	m_table.clear();
+	m_table.reserve(FIELD_COUNT * count + 1 + m_slots + count * PATH_ESTIMATE / 4);
+	m_table.resize(FIELD_COUNT * count + 1);
+	m_table.resize(FIELD_COUNT * count + 1 + m_slots, EMPTY_SLOT);
+}
+
+// Subfiles have to be added in order since each path goes on the end of the previous one.
+void Reader::add_to_table(size_t i, const char* subheader, uint32_t offset, const char* path) {
+	uint32_t path_size = Read32LE<uint32_t>(subheader + 8);
+	uint32_t start = m_table[PATH * m_count + i];
+	size_t paths = paths_start();
+
+	m_table.resize(paths + (start + path_size + 3) / 4);
+	std::memcpy(reinterpret_cast<char*>(m_table.data() + paths) + start, path, path_size);
+
+	m_table[SIZE * m_count + i] = Read32LE<uint32_t>(subheader);
+	m_table[CMP_SIZE * m_count + i] = Read32LE<uint32_t>(subheader + 4);
+	m_table[OFFSET * m_count + i] = offset;
+	m_table[CRC * m_count + i] = Read32LE<uint32_t>(subheader + 12);
+	m_table[PATH * m_count + i + 1] = start + path_size;
+}
+
+// Subfiles that run past the end of the mapping are left to fail when read from the file.
+const char* Reader::mapped(int offset, int size) const {
+	if (m_map && offset >= 0 && size >= 0 && static_cast<size_t>(offset) + size <= m_map_size) {
+		return m_map + offset;
+	}
+
+	return nullptr;
+}
+
+// Sidecar index layout:
+// Size Description
+
+// 4    "NSPI"
+// 4    Index version
+// 8    Archive size in bytes
+// 8    Archive modification time
+// 12   Archive header
+// For each subfile:
+// 16   Subheader
+// 4    Offset of the subfile contents
+// n    Path string (size from the subheader)
+// Then:
+// 4    Checksum of everything before it
+
+static const char NSPRE_INDEX_MAGIC[4] = { 'N', 'S', 'P', 'I' };
+static const unsigned int NSPRE_INDEX_VERSION = 1;
+
+// Size and modification time of the archive, which a sidecar index has to match to be used.
+static bool archive_stamp(const std::filesystem::path& path, uint64_t& size, int64_t& mtime) {
+	std::error_code ec;
+	size = std::filesystem::file_size(path, ec);
+	if (ec) return false;
+
+	mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+	return !ec;
+}
+
+bool Reader::load_index(const std::filesystem::path& index, const ReaderOptions& options) {
+	uint64_t archive_size;
+	int64_t archive_mtime;
+	if (!archive_stamp(m_path, archive_size, archive_mtime)) {
+		return false;
+	}
+
+	std::ifstream istream(index, std::ios::binary | std::ios::ate);
+	if (istream.fail()) {
+		return false;
+	}
+
+	std::streamoff index_size = istream.tellg();
+	uint64_t max_count = std::min<uint64_t>(options.max_count, NSPRE_FORMAT_MAX_SIZE / 20);
+	if (index_size < 36 + 4 || static_cast<uint64_t>(index_size) > 36 + max_count * (20 + NSPRE_PATH_MAX) + 4) {
+		return false;
+	}
+
+	std::vector<char> buffer(index_size);
+	istream.seekg(0);
+	if (!istream.read(buffer.data(), index_size)) {
+		return false;
+	}
+
+	const char* p = buffer.data();
+	const char* end = p + index_size - 4;
+
+	if (std::memcmp(p, NSPRE_INDEX_MAGIC, 4) != 0 ||
+		Read32LE<unsigned int>(p + 4) != NSPRE_INDEX_VERSION ||
+		Read64LE(p + 8) != archive_size ||
+		static_cast<int64_t>(Read64LE(p + 16)) != archive_mtime ||
+		buffer_crc(p, end - p) != Read32LE<unsigned int>(end)) {
+		return false;
+	}
+
+	// Size and modification time don't change when an archive is rewritten in place within the
+	// same clock tick, so its header has to match as well.
+	char header[12];
+	if (m_map ? m_map_size < 12 : !m_file.read(0, header, 12)) {
+		return false;
+	}
+
+	if (std::memcmp(m_map ? m_map : header, p + 24, 12) != 0) {
+		return false;
+	}
+
+	uint64_t size = Read32LE<uint32_t>(p + 24);
+	int count = Read32LE<int>(p + 32);
+	if (count < 0 || !within_limits(size, count, options)) {
+		return false;
+	}
+
+	begin_table(count);
+	p += 36;
+
+	for (int i = 0; i < count; ++i) {
+		if (end - p < 20) return false;
+
+		const char* subheader = p;
+		uint32_t offset = Read32LE<uint32_t>(p + 16);
+		int path_size = Read32LE<int>(subheader + 8);
+		p += 20;
+
+		if (path_size < 4 || path_size > NSPRE_PATH_MAX || end - p < path_size) return false;
+
+		add_to_table(i, subheader, offset, p);
+		p += path_size;
+	}
+
+	if (p != end) {
+		return false;
+	}
+
+	std::memcpy(m_header, buffer.data() + 24, 12);
+	m_size = static_cast<int>(size);
+	return true;
+}
+
+// Written to a temporary file first so a reader in another process never sees half an index.
+int Reader::save_index(const std::filesystem::path& index) {
+	if (m_error) {
+		return m_error;
+	}
+
+	uint64_t archive_size;
+	int64_t archive_mtime;
+	if (!archive_stamp(m_path, archive_size, archive_mtime)) {
+		return Error::FILE_OPEN;
+	}
+
+	std::vector<char> buffer(36);
+	std::memcpy(buffer.data(), NSPRE_INDEX_MAGIC, 4);
+	Write32LE<unsigned int>(buffer.data() + 4, NSPRE_INDEX_VERSION);
+	Write64LE(buffer.data() + 8, archive_size);
+	Write64LE(buffer.data() + 16, archive_mtime);
+	std::memcpy(buffer.data() + 24, m_header, 12);
+
+	for (const Subfile& subfile : m_files) {
+		char offset[4];
+		Write32LE<int>(offset, subfile.offset());
+		std::vector<char> subheader = subfile.subheader();
+		std::string_view path = subfile.raw_path();
+		buffer.insert(buffer.end(), subheader.begin(), subheader.end());
+		buffer.insert(buffer.end(), offset, offset + 4);
+		buffer.insert(buffer.end(), path.begin(), path.end());
+	}
+
+	char crc[4];
+	Write32LE<unsigned int>(crc, buffer_crc(buffer.data(), buffer.size()));
+	buffer.insert(buffer.end(), crc, crc + 4);
+
+	std::filesystem::path temp = index;
+	temp += ".tmp";
+
+	{
+		std::ofstream ostream(temp, std::ios::binary);
+		ostream.write(buffer.data(), buffer.size());
+		if (ostream.fail()) {
+			return Error::FILE_OPEN_OUTPUT;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(temp, index, ec);
+	if (ec) {
+		std::filesystem::remove(temp, ec);
+		return Error::FILE_OPEN_OUTPUT;
+	}
+
+	return Error::NO_ERROR;
+}
+
+// Checksum of path with every from replaced by to.
+static unsigned int replaced_crc(std::string_view path, char from, char to) {
+	char buffer[NSPRE_PATH_MAX];
+	size_t size = std::min<size_t>(path.size(), NSPRE_PATH_MAX);
+	for (size_t i = 0; i < size; ++i) {
+		buffer[i] = path[i] == from ? to : path[i];
+	}
+
+	return string_crc(std::string_view(buffer, size));
+}
+
+// Open addressed hash table of subfile indices keyed by the path checksum stored in each
+// subheader, so looking up a path doesn't need to compare it against every subfile.
+void Reader::build_index() {
+	uint32_t* slots = m_table.data() + FIELD_COUNT * m_count + 1;
+	for (size_t i = 0; i < m_count; ++i) {
+		size_t slot = field(CRC, i) & (m_slots - 1);
+		while (slots[slot] != EMPTY_SLOT) {
+			slot = (slot + 1) & (m_slots - 1);
+		}
+
+		slots[slot] = static_cast<uint32_t>(i);
+	}
+
+	m_unkeyed.clear();
+	m_unkeyed_ready = false;
+}
+
+// Stored paths should only have back slashes and be checksummed that way, but the original
+// ns-pack checksummed them with forward slashes, so find() looks up both. Subfiles with any other
+// checksum are listed the first time find() is called, which is the only time paths are checksummed.
+void Reader::list_unkeyed() {
+	std::lock_guard<std::mutex> lock(m_unkeyed_mutex);
+	if (m_unkeyed_ready) return;
+
+	for (size_t i = 0; i < m_files.size(); ++i) {
+		std::string_view path = m_files[i].prepath();
+		unsigned int crc = m_files[i].crc();
+		if (crc != replaced_crc(path, '/', '\\') && crc != replaced_crc(path, '\\', '/')) {
+			m_unkeyed.push_back(static_cast<int>(i));
+		}
+	}
+
+	m_unkeyed_ready = true;
+}
+
+Reader::Subfile* Reader::find(std::string_view prepath) {
+	if (!m_slots || prepath.size() >= NSPRE_PATH_MAX) return nullptr;
+
+	if (!m_unkeyed_ready) {
+		list_unkeyed();
+	}
+
+	auto matches = [prepath](std::string_view stored) {
+		if (stored.size() != prepath.size()) return false;
+		for (size_t i = 0; i < stored.size(); ++i) {
+			char a = stored[i] == '/' ? '\\' : stored[i];
+			char b = prepath[i] == '/' ? '\\' : prepath[i];
+			if (a != b) return false;
+		}
+
+		return true;
+	};
+
+	// The same path can be under either checksum or neither, so the first Subfile is the lowest
+	// index found in any of them. Within one probe sequence indices only increase.
+	size_t first = m_files.size();
+	unsigned int crcs[2] = { replaced_crc(prepath, '/', '\\'), replaced_crc(prepath, '\\', '/') };
+	const uint32_t* slots = m_table.data() + FIELD_COUNT * m_count + 1;
+	size_t mask = m_slots - 1;
+
+	for (int k = 0; k < (crcs[0] == crcs[1] ? 1 : 2); ++k) {
+		for (size_t slot = crcs[k] & mask; slots[slot] != EMPTY_SLOT; slot = (slot + 1) & mask) {
+			size_t i = slots[slot];
+			if (m_files[i].crc() == crcs[k] && matches(m_files[i].prepath())) {
+				first = std::min(first, i);
+				break;
+			}
+		}
+	}
+
+	for (int i : m_unkeyed) {
+		if (static_cast<size_t>(i) >= first) break;
+		if (matches(m_files[i].prepath())) {
+			first = i;
+			break;
+		}
+	}
+
+	return first < m_files.size() ? &m_files[first] : nullptr;
+}
+
+// Checks every path checksum, then if a checksum file is given checks the contents of each
+// subfile it lists. The checksum file uses the SFV layout, one "path crc" pair per line with the
+// crc in hex and lines starting with ; ignored. Contents are checked with the standard CRC-32.
+int Reader::verify(const std::filesystem::path& checksums) {
+	if (m_error) {
+		return m_error;
+	}
+
+	for (const Subfile& subfile : m_files) {
+		if (!subfile.verify_path()) {
+			return Error::BAD_CHECKSUM;
+		}
+	}
+
+	if (checksums.empty()) {
+		return Error::NO_ERROR;
+	}
+
+	std::ifstream istream(checksums);
+	if (istream.fail()) {
+		return Error::FILE_OPEN;
+	}
+
+	std::string line;
+	while (std::getline(istream, line)) {
+		while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) line.pop_back();
+		if (line.empty() || line[0] == ';') continue;
+
+		size_t split = line.find_last_of(" \t");
+		if (split == std::string::npos) {
+			return Error::BAD_FILE;
+		}
+
+		std::string_view prepath(line.data(), line.find_last_not_of(" \t", split) + 1);
+		char* end = nullptr;
+		unsigned long expected = std::strtoul(line.c_str() + split + 1, &end, 16);
+		if (*end != '\0' || prepath.empty()) {
+			return Error::BAD_FILE;
+		}
+
+		Subfile* subfile = find(prepath);
+		if (!subfile) {
+			return Error::BAD_CHECKSUM;
+		}
+
+		unsigned int crc;
+		if (int err = subfile->checksum(crc)) {
+			return err;
+		}
+
+		if (crc != expected) {
+			return Error::BAD_CHECKSUM;
+		}
+	}
+
+	return Error::NO_ERROR;
+}
+
+// Without a cache every call decompresses into a new buffer. Decompressing happens outside the
+// lock so threads missing on different Subfiles don't wait on each other. If two threads miss
+// on the same one at once the buffer that gets there first is kept.
+int Reader::extract(size_t index, SharedBuffer& data_out) {
+	if (m_error) {
+		return m_error;
+	}
+
+	if (index >= m_files.size()) {
+		return Error::EXTRACT_SUBFILE;
+	}
+
+	if (m_cache) {
+		std::lock_guard<std::mutex> lock(m_cache->mutex);
+		auto& entry = m_cache->entries[index];
+		if (entry.first) {
+			m_cache->order.splice(m_cache->order.begin(), m_cache->order, entry.second);
+			++m_cache->stats.hits;
+			data_out = entry.first;
+			return Error::NO_ERROR;
+		}
+
+		++m_cache->stats.misses;
+	}
+
+	auto buffer = std::make_shared<std::vector<char>>();
+	if (int err = m_files[index].extract(*buffer)) {
+		return err;
+	}
+
+	data_out = buffer;
+
+	// Anything bigger than the whole budget is handed out without being kept.
+	if (!m_cache || buffer->size() > m_cache->budget) {
+		return Error::NO_ERROR;
+	}
+
+	std::lock_guard<std::mutex> lock(m_cache->mutex);
+	auto& entry = m_cache->entries[index];
+	if (entry.first) {
+		data_out = entry.first;
+		return Error::NO_ERROR;
+	}
+
+	while (m_cache->stats.bytes + buffer->size() > m_cache->budget) {
+		auto& evicted = m_cache->entries[m_cache->order.back()];
+		m_cache->stats.bytes -= evicted.first->size();
+		++m_cache->stats.evictions;
+		evicted.first.reset();
+		m_cache->order.pop_back();
+	}
+
+	m_cache->order.push_front(index);
+	entry.first = buffer;
+	entry.second = m_cache->order.begin();
+	m_cache->stats.bytes += buffer->size();
+	return Error::NO_ERROR;
+}
+
+// Subfiles are stored one after another, so the contents of the ones from index on are one
+// range of the file and can be hinted all at once.
+void Reader::prefetch(size_t index, size_t bytes) {
+	if (m_error || index >= m_files.size() || !bytes) return;
+
+	const Subfile& last = m_files.back();
+	uint64_t start = m_files[index].offset();
+	uint64_t end = std::min<uint64_t>(start + bytes, static_cast<uint64_t>(last.offset()) + last.raw_size());
+	if (end <= start) return;
+
+	// Calls for each subfile in turn mostly cover what was already asked for. Only the part past
+	// the last request is asked for, and only once half the window has been used, so the system
+	// gets one hint per half window instead of one per subfile.
+	{
+		std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+		if (start >= m_prefetch_start && start <= m_prefetch_end) {
+			if (end < m_prefetch_end + (end - start) / 2) return;
+			uint64_t from = m_prefetch_end;
+			m_prefetch_end = end;
+			start = from;
+		}
+		else {
+			m_prefetch_start = start;
+			m_prefetch_end = end;
+		}
+	}
+
+	if (m_map) {
+#ifdef NSPRE_POSIX
+		size_t page = sysconf(_SC_PAGESIZE);
+		uint64_t aligned = start & ~static_cast<uint64_t>(page - 1);
+		end = std::min<uint64_t>(end, m_map_size);
+		if (end > aligned) {
+			madvise(m_map + aligned, end - aligned, MADV_WILLNEED);
+		}
+#endif
+		return;
+	}
+
+	m_file.advise(start, end - start, Advice::WILLNEED);
+}
+
+CacheStats Reader::cache_stats() {
+	if (!m_cache) {
+		return CacheStats();
+	}
+
+	std::lock_guard<std::mutex> lock(m_cache->mutex);
+	return m_cache->stats;
+}
+
+// Buffers already handed out stay valid, they're only released here.
+void Reader::clear_cache() {
+	if (!m_cache) return;
+
+	std::lock_guard<std::mutex> lock(m_cache->mutex);
+	for (auto& entry : m_cache->entries) {
+		entry.first.reset();
+	}
+
+	m_cache->order.clear();
+	m_cache->stats.bytes = 0;
+}
+
+uint32_t Reader::field(Field f, size_t i) const {
+	return m_table[f * m_count + i];
+}
+
+size_t Reader::paths_start() const {
+	return FIELD_COUNT * m_count + 1 + m_slots;
+}
+
+// The path as stored, including its null padding.
+std::string_view Reader::Subfile::raw_path() const {
+	const Reader& r = *m_reader;
+	const char* paths = reinterpret_cast<const char*>(r.m_table.data() + r.paths_start());
+	uint32_t start = r.field(PATH, m_index);
+	return std::string_view(paths + start, r.field(PATH, m_index + 1) - start);
+}
+
+std::string_view Reader::Subfile::prepath() const {
+	std::string_view path = raw_path();
+	return path.substr(0, path.find('\0'));
+}
+
+std::string_view Reader::Subfile::filename() const {
+	std::string_view path = prepath();
+	size_t slash = path.rfind('\\');
+	return slash == path.npos ? path : path.substr(slash + 1);
+}
+
+int Reader::Subfile::cmp_size() const {
+	return static_cast<int>(m_reader->field(CMP_SIZE, m_index));
+}
+
+int Reader::Subfile::size() const {
+	return static_cast<int>(m_reader->field(SIZE, m_index));
+}
+
+int Reader::Subfile::offset() const {
+	return static_cast<int>(m_reader->field(OFFSET, m_index));
+}
+
+unsigned int Reader::Subfile::crc() const {
+	return m_reader->field(CRC, m_index);
+}
+
+std::vector<char> Reader::Subfile::subheader() const {
+	std::vector<char> v(16);
+	Write32LE<int>(v.data(), size());
+	Write32LE<int>(v.data() + 4, cmp_size());
+	Write32LE<int>(v.data() + 8, static_cast<int>(raw_path().size()));
+	Write32LE<unsigned int>(v.data() + 12, crc());
+	return v;
+}
+
+// The payload in the mapping, or nullptr if the file isn't mapped.
+const char* Reader::Subfile::mapped_data() const {
+	return m_reader->mapped(offset(), raw_size());
+}
+
+const char* Reader::Subfile::data() const {
+	return cmp_size() == 0 ? mapped_data() : nullptr;
+}
+
+#ifdef __cpp_lib_span
+std::span<const char> Reader::Subfile::view() const {
+	const char* p = data();
+	return p ? std::span<const char>(p, size()) : std::span<const char>();
+}
+#endif
+
+void Reader::Subfile::prefetch() const {
+	const char* data = mapped_data();
+	if (!data) {
+		m_reader->m_file.advise(offset(), raw_size(), Advice::WILLNEED);
+		return;
+	}
+
+#ifdef NSPRE_POSIX
+	size_t file_size = raw_size();
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+	uintptr_t end = reinterpret_cast<uintptr_t>(data) + file_size;
+	madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+#endif
+}
+
+#ifndef NSPRE_CHECKPOINT_INTERVAL
+#define NSPRE_CHECKPOINT_INTERVAL 262144
+#endif
+
+// Decoder state saved every NSPRE_CHECKPOINT_INTERVAL bytes of output, so extract_range can
+// start decoding from the closest one instead of from the start of the file. list[i] is the
+// state after (i + 1) * NSPRE_CHECKPOINT_INTERVAL bytes.
+struct DecoderCheckpoints {
+	struct Checkpoint {
+		detail::Decoder decoder;
+		size_t in_pos = 0;     // Payload bytes used.
+		char history[4096]{};  // Last 4096 bytes of output, zeros before the start of the file.
+	};
+
+	std::mutex mutex;
+	std::vector<Checkpoint> list;
+};
+
+int Reader::Subfile::raw_size() const {
+	return cmp_size() ? cmp_size() : size();
+}
+
+// The payload exactly as stored, compressed or not.
+int Reader::Subfile::extract_raw(const Outfunc& outfunc) const {
+	if (!m_reader->m_file.is_open()) {
+		return Error::UNINITIALIZED;
+	}
+
+	int bytes = raw_size();
+	if (const char* data = mapped_data()) {
+		for (int pos = 0; pos < bytes; pos += NSPRE_CHUNK_SIZE) {
+			if (int err = outfunc(data + pos, std::min(bytes - pos, NSPRE_CHUNK_SIZE))) {
+				return err;
+			}
+		}
+
+		return Error::NO_ERROR;
+	}
+
+	std::vector<char> buffer(std::min(bytes, NSPRE_CHUNK_SIZE));
+	uint64_t pos = offset();
+
+	while (bytes > 0) {
+		int count = std::min(bytes, NSPRE_CHUNK_SIZE);
+		if (!m_reader->m_file.read(pos, buffer.data(), count)) {
+			return Error::READ_SUBFILE;
+		}
+
+		if (int err = outfunc(buffer.data(), count)) {
+			return err;
+		}
+
+		pos += count;
+		bytes -= count;
+	}
+
+	return Error::NO_ERROR;
+}
+
+int Reader::Subfile::extract_raw(std::vector<char>& data_out) const {
+	data_out.clear();
+	data_out.reserve(raw_size());
+
+	Outfunc outfunc = [&data_out](const char* data, size_t count) {
+		data_out.insert(data_out.end(), data, data + count);
+		return Error::NO_ERROR;
+	};
+
+	return extract_raw(outfunc);
+}
+
+int Reader::Subfile::extract(const Outfunc& outfunc) {
+	return extract<const Outfunc&>(outfunc);
+}
+
+bool Reader::Subfile::verify_path() const {
+	// The checksum doesn't include the null padding. The original ns-pack stored paths with back
+	// slashes but checksummed them as given, with forward slashes.
+	std::string_view path = prepath();
+	return string_crc(path) == crc() || replaced_crc(path, '\\', '/') == crc();
+}
+
+// Standard CRC-32 of the extracted contents, the same value zlib and SFV files use.
+int Reader::Subfile::checksum(unsigned int& crc_out) {
+	unsigned int crc = CRC_START;
+	int err = extract([&crc](const char* data, size_t count) {
+		crc = crc_update(crc, data, count);
+		return Error::NO_ERROR;
+	});
+
+	if (err) {
+		return err;
+	}
+
+	crc_out = ~crc;
+	return Error::NO_ERROR;
+}
+
+// Created on first use, along with the Reader's list of them. One lock covers creating them for
+// every Subfile in the Reader since it's only held long enough to check the pointer.
+std::shared_ptr<DecoderCheckpoints> Reader::Subfile::checkpoints() {
+	std::lock_guard<std::mutex> lock(m_reader->m_checkpoints_mutex);
+	std::vector<std::shared_ptr<DecoderCheckpoints>>& list = m_reader->m_checkpoints;
+	if (list.empty()) {
+		list.resize(m_reader->m_count);
+	}
+
+	if (!list[m_index]) {
+		list[m_index] = std::make_shared<DecoderCheckpoints>();
+	}
+
+	return list[m_index];
+}
+
+// Decodes from the closest checkpoint at or before offset, saving any new checkpoints it passes,
+// and stops as soon as the range has been output. The range is clipped to the end of the file.
+int Reader::Subfile::extract_range(size_t offset, size_t length, const Outfunc& outfunc) {
+	if (!m_reader->m_file.is_open()) {
+		return Error::UNINITIALIZED;
+	}
+
+	const char* data = mapped_data();
+	uint64_t file_offset = this->offset();
+	size_t size = this->size();
+	if (offset >= size || length == 0) {
+		return Error::NO_ERROR;
+	}
+
+	size_t end = offset + std::min(length, size - offset);
+
+	if (cmp_size() == 0) {
+		if (data) {
+			for (size_t pos = offset; pos < end; pos += NSPRE_CHUNK_SIZE) {
+				if (int err = outfunc(data + pos, std::min<size_t>(end - pos, NSPRE_CHUNK_SIZE))) {
+					return err;
+				}
+			}
+
+			return Error::NO_ERROR;
+		}
+
+		std::vector<char> buffer(std::min<size_t>(end - offset, NSPRE_CHUNK_SIZE));
+		for (size_t pos = offset; pos < end;) {
+			size_t count = std::min<size_t>(end - pos, NSPRE_CHUNK_SIZE);
+			if (!m_reader->m_file.read(file_offset + pos, buffer.data(), count)) {
+				return Error::READ_SUBFILE;
+			}
+
+			if (int err = outfunc(buffer.data(), count)) {
+				return err;
+			}
+
+			pos += count;
+		}
+
+		return Error::NO_ERROR;
+	}
+
+	const size_t interval = NSPRE_CHECKPOINT_INTERVAL;
+	std::shared_ptr<DecoderCheckpoints> saved = checkpoints();
+
+	DecoderCheckpoints::Checkpoint start;
+	{
+		std::lock_guard<std::mutex> lock(saved->mutex);
+		size_t i = std::min(offset / interval, saved->list.size());
+		if (i > 0) {
+			start = saved->list[i - 1];
+		}
+	}
+
+	detail::Decoder decoder = start.decoder;
+	detail::InputWindow in(m_reader->m_file, file_offset + start.in_pos, data ? data + start.in_pos : nullptr, cmp_size() - start.in_pos);
+	size_t in_base = start.in_pos;
+	std::vector<char> out(4096 + NSPRE_CHUNK_SIZE);
+	std::memcpy(out.data(), start.history, 4096);
+	size_t out_pos = 4096;
+
+	while (decoder.total < end) {
+		if (int err = in.fill()) {
+			return err;
+		}
+
+		// Stop at the next checkpoint so its state can be saved.
+		size_t next = (decoder.total / interval + 1) * interval;
+		size_t limit = std::min(out.size(), out_pos + (next - decoder.total));
+		size_t last_in = in.pos;
+		size_t last_out = out_pos;
+		size_t last_total = decoder.total;
+
+		decoder.decode<NSPRE_STATS_ON>(in.data, in.pos, in.size, out.data(), out_pos, limit);
+
+		if (in.pos == last_in && out_pos == last_out) {
+			// The file ends before size() bytes or partway through a lookup.
+			return Error::DECODE_SUBFILE;
+		}
+
+		size_t from = std::max(last_total, offset);
+		size_t to = std::min(decoder.total, end);
+		if (from < to) {
+			if (int err = outfunc(out.data() + last_out + (from - last_total), to - from)) {
+				return err;
+			}
+		}
+
+		if (decoder.total == next && next < size) {
+			std::lock_guard<std::mutex> lock(saved->mutex);
+			if (saved->list.size() + 1 == next / interval) {
+				DecoderCheckpoints::Checkpoint& checkpoint = saved->list.emplace_back();
+				checkpoint.decoder = decoder;
+				checkpoint.in_pos = in_base + in.consumed();
+				std::memcpy(checkpoint.history, out.data() + out_pos - 4096, 4096);
+			}
+		}
+
+		if (out_pos == out.size()) {
+			std::memmove(out.data(), out.data() + out_pos - 4096, 4096);
+			out_pos = 4096;
+		}
+	}
+
+	return Error::NO_ERROR;
+}
+
+int Reader::Subfile::extract_range(size_t offset, size_t length, std::vector<char>& data_out) {
+	data_out.clear();
+	if (offset < static_cast<size_t>(size())) {
+		data_out.reserve(std::min(length, size() - offset));
+	}
+
+	Outfunc outfunc = [&data_out](const char* data, size_t count) {
+		data_out.insert(data_out.end(), data, data + count);
+		return Error::NO_ERROR;
+	};
+
+	return extract_range(offset, length, outfunc);
+}
+
+int Reader::Subfile::extract(char* data_out) {
+	NSPRE_STAT(detail::StatTimer timer(detail::StatTimer::EXTRACT));
+	if (!m_reader->m_file.is_open()) {
+		return Error::UNINITIALIZED;
+	}
+
+	const char* data = mapped_data();
+
+	if (cmp_size() == 0) {
+		// data_out can be null for an empty file, which memcpy and read mustn't be given.
+		if (!size()) {
+			return Error::NO_ERROR;
+		}
+
+		if (data) {
+			std::memcpy(data_out, data, size());
+			return Error::NO_ERROR;
+		}
+
+		if (!m_reader->m_file.read(offset(), data_out, size())) {
+			return Error::READ_SUBFILE;
+		}
+
+		return Error::NO_ERROR;
+	}
+
+	// Decode straight into data_out. The whole file is there for lookups to copy from.
+	detail::Decoder decoder;
+	detail::InputWindow in(m_reader->m_file, offset(), data, cmp_size());
+	size_t out_pos = 0;
+
+	while (!in.done() || decoder.match_left) {
+		if (int err = in.fill()) {
+			return err;
+		}
+
+		size_t last_in = in.pos;
+		size_t last_out = out_pos;
+		decoder.decode<NSPRE_STATS_ON>(in.data, in.pos, in.size, data_out, out_pos, size());
+
+		if (in.pos == last_in && out_pos == last_out) {
+			// Either the file decodes to more than size() bytes or it ends partway through a lookup.
+			return Error::DECODE_SUBFILE;
+		}
+	}
+
+	if (out_pos != static_cast<size_t>(size())) {
+		return Error::DECODE_SUBFILE;
+	}
+
+	return Error::NO_ERROR;
+}
+
+int Reader::Subfile::extract(std::vector<char>& data_out) {
+	data_out.resize(size());
+	return extract(data_out.data());
+}
+
+int Reader::Subfile::extract(const std::filesystem::path& path) {
+	std::ofstream ostream(path, std::ios::binary);
+	if (ostream.fail()) {
+		return Error::FILE_OPEN_OUTPUT;
+	}
+
+	return extract([&ostream](const char* data, size_t count) {
+		ostream.write(data, count);
+		if (ostream.fail()) {
+			return Error::EXTRACT_SUBFILE;
+		}
+
+		return Error::NO_ERROR;
+	});
+}
+
+// LZSS compressor producing the stream described in Reader::Subfile::extract().
+
+// Input is fed in with update() and the encoded stream is appended to the output as complete
+// type byte groups become available. finish() encodes the rest of the input and appends the
+// last, possibly partial, group.
+
+// Matches are found with hash chains. Every position is hashed by its first 3 bytes (the
+// minimum match length), m_head holds the most recent position for each hash and m_prev links
+// each position to the previous one with the same hash. Only the last 4095 bytes of input are
+// searched so a match never reaches ring buffer data that the decoder has already overwritten.
+// The initial contents of the ring buffer are never referenced.
+class Compressor {
+	static constexpr size_t WINDOW = 4095;
+	static constexpr size_t MIN_MATCH = 3;
+	static constexpr size_t MAX_MATCH = 18;
+	static constexpr size_t HASH_BITS = 14;
+	static constexpr size_t BLOCK_SIZE = 262144;
+
+	// Positions are stream positions (bytes of input seen so far). m_buffer[0] holds the byte at
+	// position m_base. m_head and m_prev store position + 1 so that 0 can mean "none".
+	std::vector<char> m_buffer;
+	std::vector<size_t> m_head;
+	std::vector<size_t> m_prev;
+	size_t m_base = 0;
+	size_t m_pos = 0;
+	size_t m_end = 0;
+	size_t m_insert = 0;
+	int m_max_chain;
+	int m_parse;
+
+	// Per block scratch space for the optimal parse.
+	std::vector<uint8_t> m_lengths;
+	std::vector<size_t> m_positions;
+	std::vector<uint32_t> m_costs;
+	std::vector<uint8_t> m_choices;
+
+	char m_group[17];
+	int m_group_size = 1;
+	int m_group_count = 0;
+#ifdef NSPRE_STATS
+	detail::TokenCounts m_counts;
+#endif
+
+	static size_t hash(const char* p) {
+		unsigned int v = static_cast<unsigned char>(p[0]);
+		v |= static_cast<unsigned char>(p[1]) << 8;
+		v |= static_cast<unsigned char>(p[2]) << 16;
+		return (v * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	void insert_to(size_t pos) {
+		while (m_insert < pos && m_insert + MIN_MATCH <= m_end) {
+			size_t h = hash(&m_buffer[m_insert - m_base]);
+			m_prev[m_insert % 4096] = m_head[h];
+			m_head[h] = m_insert + 1;
+			++m_insert;
+		}
+	}
+
+	size_t find_match(size_t pos, size_t& match_pos) {
+		size_t max_len = std::min(MAX_MATCH, m_end - pos);
+		if (max_len < MIN_MATCH) return 0;
+
+		const char* cur = &m_buffer[pos - m_base];
+		size_t best_len = 0;
+		size_t next = m_head[hash(cur)];
+
+		for (int chain = m_max_chain; next && chain > 0; --chain) {
+			size_t cand = next - 1;
+			if (pos - cand > WINDOW) break;
+
+			const char* c = &m_buffer[cand - m_base];
+			if (c[best_len] == cur[best_len]) {
+				size_t len = 0;
+				while (len < max_len && c[len] == cur[len]) ++len;
+				if (len > best_len) {
+					best_len = len;
+					match_pos = cand;
+					if (len == max_len) break;
+				}
+			}
+
+			next = m_prev[cand % 4096];
+		}
+
+		return best_len >= MIN_MATCH ? best_len : 0;
+	}
+
+	void flush_group(std::vector<char>& out) {
+		if (m_group_count) {
+			out.insert(out.end(), m_group, m_group + m_group_size);
+		}
+
+		m_group[0] = 0;
+		m_group_size = 1;
+		m_group_count = 0;
+	}
+
+	void literal(char c, std::vector<char>& out) {
+		NSPRE_STAT(m_counts.literal());
+		m_group[0] |= 1 << m_group_count;
+		m_group[m_group_size++] = c;
+		if (++m_group_count == 8) flush_group(out);
+	}
+
+	void match(size_t pos, size_t len, std::vector<char>& out) {
+		NSPRE_STAT(m_counts.match(len));
+		unsigned int offset = (4078 + pos) % 4096;
+		m_group[m_group_size++] = static_cast<char>(offset & 0xff);
+		m_group[m_group_size++] = static_cast<char>(((offset >> 4) & 0xf0) | (len - MIN_MATCH));
+		if (++m_group_count == 8) flush_group(out);
+	}
+
+	void encode(size_t limit, std::vector<char>& out) {
+		if (m_parse == PARSE_OPTIMAL) {
+			encode_optimal(limit, out);
+		}
+		else if (m_parse == PARSE_LAZY) {
+			encode_lazy(limit, out);
+		}
+		else {
+			encode_greedy(limit, out);
+		}
+	}
+
+	// Take the longest match at each position.
+	void encode_greedy(size_t limit, std::vector<char>& out) {
+		while (m_pos < limit) {
+			insert_to(m_pos);
+
+			size_t match_pos;
+			size_t len = find_match(m_pos, match_pos);
+			if (len) {
+				match(match_pos, len, out);
+				m_pos += len;
+			}
+			else {
+				literal(m_buffer[m_pos - m_base], out);
+				++m_pos;
+			}
+		}
+	}
+
+	// Before taking a match, check whether the next position has a longer one. If it does, output
+	// a literal and consider that match instead.
+	void encode_lazy(size_t limit, std::vector<char>& out) {
+		size_t match_pos = 0;
+		size_t len = 0;
+		bool pending = false;
+
+		while (m_pos < limit) {
+			insert_to(m_pos);
+			if (!pending) {
+				len = find_match(m_pos, match_pos);
+			}
+
+			pending = false;
+
+			if (len && len < MAX_MATCH && m_pos + 1 < limit) {
+				insert_to(m_pos + 1);
+				size_t next_pos;
+				size_t next_len = find_match(m_pos + 1, next_pos);
+				if (next_len > len) {
+					literal(m_buffer[m_pos - m_base], out);
+					++m_pos;
+					len = next_len;
+					match_pos = next_pos;
+					pending = true;
+					continue;
+				}
+			}
+
+			if (len) {
+				match(match_pos, len, out);
+				m_pos += len;
+			}
+			else {
+				literal(m_buffer[m_pos - m_base], out);
+				++m_pos;
+			}
+		}
+	}
+
+	// Every literal costs 9 bits and every lookup 17 including its type bit, no matter the
+	// distance. So the cheapest encoding of the block can be found from just the longest match at
+	// each position, since any shorter length at the same distance is also a valid lookup.
+	// Lookups don't cross the end of the block.
+	void encode_optimal(size_t limit, std::vector<char>& out) {
+		if (m_pos >= limit) return;
+
+		size_t n = limit - m_pos;
+		m_lengths.resize(n);
+		m_positions.resize(n);
+		m_costs.resize(n + 1);
+		m_choices.resize(n + 1);
+
+		for (size_t i = 0; i < n; ++i) {
+			insert_to(m_pos + i);
+			size_t match_pos = 0;
+			size_t len = find_match(m_pos + i, match_pos);
+			m_lengths[i] = static_cast<uint8_t>(std::min(len, n - i));
+			m_positions[i] = match_pos;
+		}
+
+		m_costs[n] = 0;
+		for (size_t i = n; i-- > 0;) {
+			m_costs[i] = m_costs[i + 1] + 9;
+			m_choices[i] = 1;
+
+			for (size_t len = MIN_MATCH; len <= m_lengths[i]; ++len) {
+				if (m_costs[i + len] + 17 < m_costs[i]) {
+					m_costs[i] = m_costs[i + len] + 17;
+					m_choices[i] = static_cast<uint8_t>(len);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < n; i += m_choices[i]) {
+			if (m_choices[i] == 1) {
+				literal(m_buffer[m_pos + i - m_base], out);
+			}
+			else {
+				match(m_positions[i], m_choices[i], out);
+			}
+		}
+
+		m_pos = limit;
+	}
+
+	// Drop input that can no longer be referenced to make room for more.
+	void slide() {
+		size_t keep = m_pos > m_base + WINDOW ? m_pos - WINDOW : m_base;
+		std::memmove(m_buffer.data(), m_buffer.data() + (keep - m_base), m_end - keep);
+		m_base = keep;
+	}
+
+	enum Parse { PARSE_GREEDY, PARSE_LAZY, PARSE_OPTIMAL };
+
+public:
+	// Levels 1-3 take the longest match found, 4-6 look one position ahead for a longer one and
+	// 7-9 find the cheapest encoding of each block. Higher levels within each also search longer
+	// hash chains. 9 searches the whole window.
+	Compressor(int level = 3) :
+		m_buffer(WINDOW + BLOCK_SIZE + MAX_MATCH),
+		m_head(size_t(1) << HASH_BITS, 0),
+		m_prev(4096, 0)
+	{
+		static const int chains[] = { 1, 4, 32, 32, 128, 512, 128, 512, 4096 };
+		level = std::min(std::max(level, 1), 9);
+		m_max_chain = chains[level - 1];
+		m_parse = level <= 3 ? PARSE_GREEDY : level <= 6 ? PARSE_LAZY : PARSE_OPTIMAL;
+		m_group[0] = 0;
+	}
+
+	void update(const char* data, size_t size, std::vector<char>& out) {
+		while (size > 0) {
+			if (m_end - m_base == m_buffer.size()) {
+				// Hold back enough input that a match is never cut short by the end of the buffer.
+				encode(m_end - MAX_MATCH, out);
+				slide();
+			}
+
+			size_t count = std::min(size, m_buffer.size() - (m_end - m_base));
+			std::memcpy(m_buffer.data() + (m_end - m_base), data, count);
+			m_end += count;
+			data += count;
+			size -= count;
+		}
+	}
+
+	void finish(std::vector<char>& out) {
+		encode(m_end, out);
+		flush_group(out);
+	}
+
+#ifdef NSPRE_STATS
+	// Counted only for output that's kept, not for probes or data that ends up stored.
+	void add_stats() {
+		detail::add_stats(m_counts);
+		m_counts = detail::TokenCounts();
+	}
+#endif
+};
+
+// Where an archive is written to, either a file or a vector in memory. Values that aren't known
+// until later are written as placeholders and patched afterwards.
+class WriteTarget {
+	std::ofstream* m_stream = nullptr;
+	std::vector<char>* m_memory = nullptr;
+public:
+	WriteTarget(std::ofstream& stream) : m_stream(&stream) {}
+	WriteTarget(std::vector<char>& memory) : m_memory(&memory) {}
+
+	bool write(const char* data, size_t size) {
+		if (m_memory) {
+			m_memory->insert(m_memory->end(), data, data + size);
+			return true;
+		}
+
+		m_stream->write(data, size);
+		return !m_stream->fail();
+	}
+
+	uint64_t tell() {
+		return m_memory ? m_memory->size() : static_cast<uint64_t>(m_stream->tellp());
+	}
+
+	// Drop everything written from pos on. A file keeps its length until it's closed, which is
+	// left to the caller, but later writes start from pos.
+	bool truncate(uint64_t pos) {
+		if (m_memory) {
+			m_memory->resize(pos);
+			return true;
+		}
+
+		m_stream->seekp(pos);
+		return !m_stream->fail();
+	}
+
+	bool patch(uint64_t pos, const char* data, size_t size) {
+		if (m_memory) {
+			std::memcpy(m_memory->data() + pos, data, size);
+			return true;
+		}
+
+		std::streampos end = m_stream->tellp();
+		m_stream->seekp(pos);
+		m_stream->write(data, size);
+		m_stream->seekp(end);
+		return !m_stream->fail();
+	}
+};
+
+static std::vector<char> subfile_path(const std::string& prepath) {
+	std::vector<char> path_buffer(prepath.begin(), prepath.end());
 
 	// Convert forward slashes to back slashes just in case.
 	for (char& c : path_buffer) {
@@ -654,41 +2742,380 @@ static int write_subfile(std::ofstream& ostream, Subfile& subfile) {
 		path_buffer.push_back(0);
 	}
 
+	return path_buffer;
+}
+
+#ifndef NSPRE_PROBE_SIZE
+#define NSPRE_PROBE_SIZE 4096
+#endif
+
+// LZSS has no way to shrink data without repeats, and makes data that's already compressed or
+// random about an eighth bigger. A greedy parse of a sample, finding repeats through a small
+// table of the last position of each 3 byte hash, estimates what compressing it would cost
+// without building a Compressor. It misses some repeats the Compressor would find, so it only
+// leaves out data that's close to not shrinking anyway.
+static bool compressible(const char* data, size_t size) {
+	uint32_t last[4096] = {};   // Position + 1 of the last 3 bytes with each hash, 0 for none.
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+	size_t bits = 0;
+	size_t pos = 0;
+
+	while (pos < size) {
+		size_t length = 0;
+		if (pos + 3 <= size) {
+			unsigned int hash = ((in[pos] << 16 | in[pos + 1] << 8 | in[pos + 2]) * 2654435761u) >> 20;
+			size_t match = last[hash];
+			last[hash] = static_cast<uint32_t>(pos + 1);
+
+			// Lookups only reach back as far as the ring buffer.
+			if (match-- && pos - match <= 4096) {
+				while (pos + length < size && length < 18 && in[match + length] == in[pos + length]) {
+					++length;
+				}
+			}
+		}
+
+		if (length >= 3) {
+			bits += 17;
+			pos += length;
+		}
+		else {
+			bits += 9;
+			++pos;
+		}
+	}
+
+	return bits < size * 8;
+}
+
+// Sources are streamed through in chunks so memory use doesn't depend on their size. The sizes
+// aren't known until all of the source has been read, so the subheader is written with them
+// blank and patched at the end the same way the file header is.
+//
+// A subfile is stored instead of compressed if an estimate for its first NSPRE_PROBE_SIZE bytes
+// doesn't shrink, or if compressing all of it didn't save any space. In the second case the
+// compressed data is dropped and the source is read again.
+int Writer::write_entry(WriteTarget& out, const Entry& entry, Mode mode) const {
+	NSPRE_STAT(detail::StatTimer timer(detail::StatTimer::WRITE));
+	if (entry.subfile || entry.raw) {
+		return write_raw(out, entry);
+	}
+
+	std::ifstream stream;
+	if (!entry.source.empty()) {
+		stream.open(entry.source, std::ios::binary);
+		if (stream.fail()) {
+			return Error::FILE_OPEN;
+		}
+	}
+
+	std::vector<char> path_buffer = subfile_path(entry.prepath);
+
 	char header[16]{};
-	Write32LE<int>(header, file_buffer.size());
-	Write32LE<int>(header + 4, 0);
 	Write32LE<int>(header + 8, path_buffer.size());
-	Write32LE<unsigned int>(header + 12, string_crc(subfile.prepath()));
+	Write32LE<unsigned int>(header + 12, string_crc(std::string_view(path_buffer.data(), entry.prepath.size())));
 
-	ostream.write(header, 16);
-	if (ostream.fail()) {
+	uint64_t header_pos = out.tell();
+	if (!out.write(header, 16)) {
 		return Error::WRITE_SUBHEADER;
 	}
 
-	ostream.write(path_buffer.data(), path_buffer.size());
-	if (ostream.fail()) {
+	if (!out.write(path_buffer.data(), path_buffer.size())) {
 		return Error::WRITE_SUBPATH;
 	}
 
+	uint64_t data_pos = out.tell();
+
+	const size_t read_size = 1048576;
+	std::vector<char> buffer;
+	const char* memory = entry.data ? entry.data : entry.buffer.data();
+	const size_t memory_size = entry.data ? entry.size : entry.buffer.size();
+	size_t memory_pos = 0;
+
+	// Get the next piece of the source, 0 at the end.
+	auto next = [&](const char*& chunk) -> size_t {
+		if (stream.is_open()) {
+			if (!stream) return 0;
+			buffer.resize(read_size);
+			stream.read(buffer.data(), read_size);
+			NSPRE_STAT(++stat_counters.reads);
+			NSPRE_STAT(stat_counters.bytes_read += stream.gcount());
+			chunk = buffer.data();
+			return stream.gcount();
+		}
+
+		size_t count = std::min(memory_size - memory_pos, read_size);
+		chunk = memory + memory_pos;
+		memory_pos += count;
+		return count;
+	};
+
+	auto rewind = [&]() {
+		if (stream.is_open()) {
+			stream.clear();
+			stream.seekg(0);
+		}
+
+		memory_pos = 0;
+	};
+
+	std::vector<char> cmp_buffer;
+	std::unique_ptr<Compressor> compressor;
+
+	size_t size = 0;
+	size_t data_size = 0;
+
+	// Compress a piece of the source if needed and write it out.
+	auto put = [&](const char* data, size_t count) {
+		size += count;
+
+		if (compressor) {
+			cmp_buffer.clear();
+			compressor->update(data, count, cmp_buffer);
+			data = cmp_buffer.data();
+			count = cmp_buffer.size();
+		}
+
+		data_size += count;
+		return out.write(data, count);
+	};
+
+	const char* chunk = nullptr;
+	size_t count = next(chunk);
+	if (mode != STORE && count > 0 && compressible(chunk, std::min<size_t>(count, NSPRE_PROBE_SIZE))) {
+		compressor = std::make_unique<Compressor>(m_options.level);
+	}
+
+	// The caller writes the subfile again with STORE, which is what gets counted as the write.
+	auto skip = [&]() {
+		NSPRE_STAT(--stat_counters.writes);
+		return out.truncate(header_pos) ? Error::NO_ERROR : Error::WRITE_SUBFILE;
+	};
+
+	if (mode == TRY_COMPRESS && !compressor) {
+		return skip();
+	}
+
+	for (;;) {
+		for (; count > 0; count = next(chunk)) {
+			if (!put(chunk, count)) {
+				return Error::WRITE_SUBFILE;
+			}
+		}
+
+		if (stream.bad()) {
+			return Error::READ_SOURCE;
+		}
+
+		if (compressor) {
+			cmp_buffer.clear();
+			compressor->finish(cmp_buffer);
+			if (!out.write(cmp_buffer.data(), cmp_buffer.size())) {
+				return Error::WRITE_SUBFILE;
+			}
+
+			data_size += cmp_buffer.size();
+		}
+
+		if (!compressor || data_size < size) {
+			NSPRE_STAT(if (compressor) compressor->add_stats());
+			break;
+		}
+
+		if (mode == TRY_COMPRESS) {
+			return skip();
+		}
+
+		if (!out.truncate(data_pos)) {
+			return Error::WRITE_SUBFILE;
+		}
+
+		compressor.reset();
+		size = 0;
+		data_size = 0;
+		rewind();
+		count = next(chunk);
+	}
+
 	// Pad end of file to maintain alignment.
-	padding = (file_buffer.size() % 4) ? 4 - (file_buffer.size() % 4) : 0;
-	for (int i = 0; i < padding; ++i) {
-		file_buffer.push_back(0);
+	const char zeros[4]{};
+	int padding = (data_size % 4) ? 4 - (data_size % 4) : 0;
+	if (!out.write(zeros, padding)) {
+		return Error::WRITE_SUBFILE;
 	}
 
-	ostream.write(file_buffer.data(), file_buffer.size());
-	if (ostream.fail()) {
+	// An empty file has no compressed data and is stored.
+	Write32LE<int>(header, size);
+	Write32LE<int>(header + 4, compressor ? data_size : 0);
+	if (!out.patch(header_pos, header, 8)) {
+		return Error::WRITE_SUBHEADER;
+	}
+
+	return Error::NO_ERROR;
+}
+
+// Copy a payload that's already encoded, either from an open archive or from memory, with the
+// sizes from its original subheader. A subfile keeping its path also keeps the path bytes and
+// checksum exactly as they were.
+int Writer::write_raw(WriteTarget& out, const Entry& entry) const {
+	char header[16];
+	std::vector<char> path_buffer;
+
+	if (entry.subfile) {
+		std::vector<char> subheader = entry.subfile->subheader();
+		std::memcpy(header, subheader.data(), 16);
+
+		if (entry.subfile->prepath() == entry.prepath) {
+			std::string_view stored = entry.subfile->raw_path();
+			path_buffer.assign(stored.begin(), stored.end());
+		}
+	}
+	else {
+		std::memcpy(header, entry.sizes, 8);
+	}
+
+	if (path_buffer.empty()) {
+		path_buffer = subfile_path(entry.prepath);
+		Write32LE<int>(header + 8, path_buffer.size());
+		Write32LE<unsigned int>(header + 12, string_crc(std::string_view(path_buffer.data(), entry.prepath.size())));
+	}
+
+	if (!out.write(header, 16)) {
+		return Error::WRITE_SUBHEADER;
+	}
+
+	if (!out.write(path_buffer.data(), path_buffer.size())) {
+		return Error::WRITE_SUBPATH;
+	}
+
+	size_t data_size = 0;
+	Reader::Outfunc put = [&](const char* data, size_t count) {
+		data_size += count;
+		return out.write(data, count) ? Error::NO_ERROR : Error::WRITE_SUBFILE;
+	};
+
+	if (entry.subfile) {
+		if (int err = entry.subfile->extract_raw(put)) {
+			return err;
+		}
+	}
+	else {
+		const char* data = entry.data ? entry.data : entry.buffer.data();
+		size_t size = entry.data ? entry.size : entry.buffer.size();
+		if (int err = put(data, size)) {
+			return err;
+		}
+	}
+
+	const char zeros[4]{};
+	int padding = (data_size % 4) ? 4 - (data_size % 4) : 0;
+	if (!out.write(zeros, padding)) {
 		return Error::WRITE_SUBFILE;
 	}
 
 	return Error::NO_ERROR;
 }
 
-int write(Subfile* subfiles, size_t count, const std::filesystem::path& path) {
+// Compress subfiles on a pool of threads while this thread writes them out in order. Each
+// worker writes a whole subfile to memory. Workers only run a limited distance ahead of the
+// writer so the number of subfiles held in memory stays bounded.
+// Only subfiles that might compress are handed to the threads, at most window of them past the
+// last one written. Threads compress into memory and give up on any that wouldn't shrink, and
+// those and raw payloads are streamed straight to out in order the same way write() does, so the
+// only whole subfiles held in memory are compressed ones.
+int Writer::write_parallel(WriteTarget& out, const std::vector<const Entry*>& entries, unsigned int threads) const {
+	const size_t count = entries.size();
+	const size_t window = threads * 2;
+
+	auto compressing = [&](size_t i) {
+		return !entries[i]->subfile && !entries[i]->raw;
+	};
 
-	std::ofstream ostream(path, std::ios::binary);
-	if (ostream.fail()) {
-		return Error::FILE_OPEN_OUTPUT;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<std::vector<char>> slots(count);
+	std::vector<int> results(count, Error::NO_ERROR);
+	std::vector<bool> done(count, false);
+	size_t next = 0;
+	size_t written = 0;
+	bool abort = false;
+
+	auto worker = [&]() {
+		for (;;) {
+			size_t i;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (next < count && !compressing(next)) ++next;
+				cv.wait(lock, [&]() { return abort || next >= count || next < written + window; });
+				if (abort || next >= count) return;
+				i = next++;
+			}
+
+			std::vector<char> encoded;
+			WriteTarget target(encoded);
+			int err = write_entry(target, *entries[i], TRY_COMPRESS);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slots[i] = std::move(encoded);
+				results[i] = err;
+				done[i] = true;
+			}
+			cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int i = 0; i < threads; ++i) {
+		pool.emplace_back(worker);
+	}
+
+	int err = Error::NO_ERROR;
+	for (size_t i = 0; i < count && !err; ++i) {
+		std::vector<char> encoded;
+		if (compressing(i)) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]() { return done[i]; });
+			encoded = std::move(slots[i]);
+			err = results[i];
+		}
+
+		// Nothing encoded means the subfile is stored.
+		if (!err && encoded.empty()) {
+			err = write_entry(out, *entries[i], STORE);
+		}
+		else if (!err && !out.write(encoded.data(), encoded.size())) {
+			err = Error::WRITE_SUBFILE;
+		}
+
+		if (!err && too_large(out)) {
+			err = Error::TOO_LARGE;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++written;
+			if (err) abort = true;
+		}
+		cv.notify_all();
+	}
+
+	for (std::thread& t : pool) {
+		t.join();
+	}
+
+	return err;
+}
+
+// Checked after each subfile so an archive over the limit stops growing as soon as it passes it.
+bool Writer::too_large(WriteTarget& out) const {
+	return out.tell() > std::min<uint64_t>(m_options.max_size, NSPRE_FORMAT_MAX_SIZE);
+}
+
+int Writer::write(WriteTarget& out, const std::vector<const Entry*>& entries) const {
+	const size_t count = entries.size();
+	if (count > std::min<uint64_t>(m_options.max_count, NSPRE_FORMAT_MAX_SIZE)) {
+		return Error::TOO_LARGE;
 	}
 
 	char header[12];
@@ -698,29 +3125,274 @@ int write(Subfile* subfiles, size_t count, const std::filesystem::path& path) {
 	header[7] = 0xab;
 	Write32LE<int>(header + 8, count);
 
-	ostream.write(header, 12);
-	if (ostream.fail()) {
+	if (!out.write(header, 12)) {
 		return Error::WRITE_HEADER;
 	}
 
-	for (int i = 0; i < count; ++i) {
-		if (int err = write_subfile(ostream, subfiles[i])) {
+	// Only compression is worth spreading across threads.
+	unsigned int threads = m_options.threads ? m_options.threads : std::thread::hardware_concurrency();
+	threads = std::min<size_t>(std::max(threads, 1u), count);
+
+	if (m_options.compress && threads > 1) {
+		if (int err = write_parallel(out, entries, threads)) {
 			return err;
 		}
 	}
+	else {
+		for (const Entry* entry : entries) {
+			if (int err = write_entry(out, *entry, m_options.compress ? COMPRESS : STORE)) {
+				return err;
+			}
 
-	Write32LE<unsigned int>(header, static_cast<unsigned int>(ostream.tellp()));
-	ostream.seekp(0);
-	ostream.write(header, 12);
-	if (ostream.fail()) {
+			if (too_large(out)) {
+				return Error::TOO_LARGE;
+			}
+		}
+	}
+
+	Write32LE<unsigned int>(header, static_cast<unsigned int>(out.tell()));
+	if (!out.patch(0, header, 12)) {
 		return Error::WRITE_HEADER;
 	}
 
 	return Error::NO_ERROR;
 }
 
-int write(std::vector<Subfile>& subfiles, const std::filesystem::path& path) {
-	return write(subfiles.data(), subfiles.size(), path);
+int Writer::write(WriteTarget& out) const {
+	std::vector<const Entry*> entries;
+	entries.reserve(m_entries.size());
+	for (const Entry& entry : m_entries) {
+		entries.push_back(&entry);
+	}
+
+	return write(out, entries);
+}
+
+void Writer::add(const std::filesystem::path& source, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.source = source;
+}
+
+void Writer::add(Subfile& subfile) {
+	add(subfile.source, subfile.prepath());
+}
+
+void Writer::add(Reader::Subfile& subfile) {
+	add(subfile, std::string(subfile.prepath()));
+}
+
+void Writer::add(Reader::Subfile& subfile, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.subfile = &subfile;
+}
+
+void Writer::add(Reader& reader) {
+	for (Reader::Subfile& subfile : reader.files()) {
+		add(subfile);
+	}
+}
+
+// Only the sizes are used from the subheader, the path size and checksum come from prepath.
+void Writer::add_raw(const char* subheader, const char* data, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.raw = true;
+	std::memcpy(entry.sizes, subheader, 8);
+	entry.data = data;
+	entry.size = Read32LE<int>(subheader + 4) ? Read32LE<int>(subheader + 4) : Read32LE<int>(subheader);
+}
+
+void Writer::add_raw(const char* subheader, std::vector<char>&& data, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.raw = true;
+	std::memcpy(entry.sizes, subheader, 8);
+	entry.buffer = std::move(data);
+}
+
+void Writer::add(const char* data, size_t size, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.data = data;
+	entry.size = size;
+}
+
+void Writer::add(std::vector<char>&& data, const std::string& prepath) {
+	Entry& entry = m_entries.emplace_back();
+	entry.prepath = prepath;
+	entry.buffer = std::move(data);
+}
+
+#ifdef __cpp_lib_span
+void Writer::add(std::span<const char> data, const std::string& prepath) {
+	add(data.data(), data.size(), prepath);
+}
+#endif
+
+size_t Writer::count() const {
+	return m_entries.size();
+}
+
+void Writer::clear() {
+	m_entries.clear();
+}
+
+// A subfile that ended up stored after being compressed is written over the compressed data,
+// so if the last one was, the file is cut down to the end of the archive after closing.
+int Writer::write(const std::filesystem::path& path, const std::vector<const Entry*>& entries) const {
+	std::ofstream ostream(path, std::ios::binary);
+	if (ostream.fail()) {
+		return Error::FILE_OPEN_OUTPUT;
+	}
+
+	WriteTarget out(ostream);
+	if (int err = write(out, entries)) {
+		return err;
+	}
+
+	uint64_t end = out.tell();
+	ostream.close();
+	if (ostream.fail()) {
+		return Error::WRITE_SUBFILE;
+	}
+
+	std::error_code ec;
+	if (std::filesystem::file_size(path, ec) > end && !ec) {
+		std::filesystem::resize_file(path, end, ec);
+	}
+
+	return ec ? Error::WRITE_SUBFILE : Error::NO_ERROR;
+}
+
+int Writer::write(const std::filesystem::path& path) const {
+	std::vector<const Entry*> entries;
+	entries.reserve(m_entries.size());
+	for (const Entry& entry : m_entries) {
+		entries.push_back(&entry);
+	}
+
+	return write(path, entries);
+}
+
+int Writer::write(std::vector<char>& data_out) const {
+	// Reserve what the archive would take up uncompressed so it's unlikely to be reallocated
+	// and copied as it grows.
+	size_t estimate = 12;
+	for (const Entry& entry : m_entries) {
+		size_t size = entry.data ? entry.size : entry.buffer.size();
+		if (entry.subfile) {
+			size = entry.subfile->raw_size();
+		}
+		else if (!entry.source.empty()) {
+			std::error_code ec;
+			size = std::filesystem::file_size(entry.source, ec);
+			if (ec) size = 0;
+		}
+
+		estimate += 16 + entry.prepath.size() + 4 + size + 3;
+	}
+
+	data_out.clear();
+	data_out.reserve(estimate);
+
+	WriteTarget out(data_out);
+	return write(out);
+}
+
+// The archive is rewritten to a temporary file next to it with every unchanged subfile copied
+// across as it is, then moved over the original.
+int Writer::update(const std::filesystem::path& path, const std::vector<std::string>& remove) const {
+	std::filesystem::path temp = path;
+	temp += ".tmp";
+
+	{
+		ReaderOptions options;
+		options.max_size = m_options.max_size;
+		options.max_count = m_options.max_count;
+
+		Reader reader(path, options);
+		if (reader.error()) {
+			return reader.error();
+		}
+
+		std::vector<Reader::Subfile>& files = reader.files();
+		std::vector<Entry> kept(files.size());
+		for (size_t i = 0; i < files.size(); ++i) {
+			kept[i].prepath = files[i].prepath();
+			kept[i].subfile = &files[i];
+		}
+
+		// What goes in place of each existing subfile, nullptr to drop it.
+		std::vector<const Entry*> slots(files.size());
+		for (size_t i = 0; i < files.size(); ++i) {
+			slots[i] = &kept[i];
+		}
+
+		// Every Subfile with a path in remove is dropped. find() gives the first, and any other with
+		// the same path finds that same first one.
+		for (const std::string& prepath : remove) {
+			Reader::Subfile* first = reader.find(prepath);
+			if (!first) {
+				return Error::NOT_FOUND;
+			}
+
+			for (size_t i = first - files.data(); i < files.size(); ++i) {
+				if (reader.find(files[i].prepath()) == first) {
+					slots[i] = nullptr;
+				}
+			}
+		}
+
+		// Entries replace the first subfile with the same path unless it was removed or already
+		// replaced, the rest are added at the end.
+		std::vector<const Entry*> added;
+		for (const Entry& entry : m_entries) {
+			Reader::Subfile* subfile = reader.find(entry.prepath);
+			if (subfile && slots[subfile - files.data()] == &kept[subfile - files.data()]) {
+				slots[subfile - files.data()] = &entry;
+			}
+			else {
+				added.push_back(&entry);
+			}
+		}
+
+		std::vector<const Entry*> entries;
+		for (const Entry* entry : slots) {
+			if (entry) entries.push_back(entry);
+		}
+
+		entries.insert(entries.end(), added.begin(), added.end());
+
+		if (int err = write(temp, entries)) {
+			std::error_code ec;
+			std::filesystem::remove(temp, ec);
+			return err;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(temp, path, ec);
+	if (ec) {
+		std::filesystem::remove(temp, ec);
+		return Error::FILE_OPEN_OUTPUT;
+	}
+
+	return Error::NO_ERROR;
+}
+
+int write(Subfile* subfiles, size_t count, const std::filesystem::path& path, const WriterOptions& options) {
+	Writer writer(options);
+	for (size_t i = 0; i < count; ++i) {
+		writer.add(subfiles[i]);
+	}
+
+	return writer.write(path);
+}
+
+int write(std::vector<Subfile>& subfiles, const std::filesystem::path& path, const WriterOptions& options) {
+	return write(subfiles.data(), subfiles.size(), path, options);
 }
 
 #endif
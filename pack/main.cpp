@@ -21,15 +21,30 @@
 #define NSPRE_IMPL
 #include "nspre.hpp"
 #include <cstring>
+#include <cstdlib>
 
 std::vector<nspre::Subfile> in_files;
 std::filesystem::path out_file = "out.pre";
+nspre::WriterOptions options;
+bool update = false;
+std::vector<std::string> remove_paths;
+bool show_stats = false;
+bool stats_json = false;
 
 void print_help() {
 	std::printf(
 		"ns-pack - Create pre file from list of files.\n"
 		"Usage: ns-pack [OPTIONS] [FILE LIST]\n"
 		"  -o  Output file. Default is ./out.pre\n"
+		"  -c  Compress files\n"
+		"  -1..-9  Compress files at this level - 1 is fastest, 9 is smallest. -c is -3\n"
+		"  -j  Number of threads to compress with. 0 uses one per core. Default is 1\n"
+		"  --update  Update the output file in place - Files replace ones with the same\n"
+		"            internal path, new ones are added and the rest are copied as they are\n"
+		"  --remove  Internal path of a file to remove when updating. Can be repeated\n"
+		"  --stats       Show literals, lookups, match lengths, read calls and time spent\n"
+		"                writing each file\n"
+		"  --stats=json  The same as JSON\n"
 		"  -h  Show this help message\n"
 		"\n"
 		"File list format:\n"
@@ -38,6 +53,14 @@ void print_help() {
 	);
 }
 
+void print_stats() {
+#ifdef NSPRE_STATS
+	std::fputs(nspre::stats().report(stats_json).c_str(), stdout);
+#else
+	std::fprintf(stderr, "--stats isn't available, built without NSPRE_STATS\n");
+#endif
+}
+
 int parse_filelist(std::string list) {
 	std::vector<std::string> vals;
 
@@ -76,6 +99,29 @@ int main(int argc, char** argv)
 			out_file = argv[i + 1];
 			++i;
 		}
+		else if (has_val && std::strcmp(argv[i], "-j") == 0) {
+			options.threads = std::atoi(argv[i + 1]);
+			++i;
+		}
+		else if (has_val && std::strcmp(argv[i], "--remove") == 0) {
+			remove_paths.push_back(argv[i + 1]);
+			update = true;
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--stats") == 0 || std::strcmp(argv[i], "--stats=json") == 0) {
+			show_stats = true;
+			stats_json = argv[i][7] == '=';
+		}
+		else if (std::strcmp(argv[i], "--update") == 0) {
+			update = true;
+		}
+		else if (std::strcmp(argv[i], "-c") == 0) {
+			options.compress = true;
+		}
+		else if (argv[i][0] == '-' && argv[i][1] >= '1' && argv[i][1] <= '9' && argv[i][2] == '\0') {
+			options.compress = true;
+			options.level = argv[i][1] - '0';
+		}
 		else if (std::strcmp(argv[i], "-h") == 0) {
 			print_help();
 			return 0;
@@ -85,17 +131,49 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if (!in_files.size()) {
+	if (!in_files.size() && !(update && remove_paths.size())) {
 		std::fprintf(stderr, "no input files\n");
 		print_help();
 		return -1;
 	}
 
-	if (int err = nspre::write(in_files, out_file)) {
+	if (remove_paths.size() && !std::filesystem::exists(out_file)) {
+		std::fprintf(stderr, "can't remove files from %s, it doesn't exist\n", out_file.string().c_str());
+		return -1;
+	}
+
+	// Pre files are written up to the format's limits, with a warning below if the result is past
+	// what a Reader opens by default.
+	options.max_size = NSPRE_FORMAT_MAX_SIZE;
+	options.max_count = NSPRE_FORMAT_MAX_SIZE;
+
+	// Updating a file that doesn't exist yet just creates it.
+	int err;
+	bool updated = update && std::filesystem::exists(out_file);
+	if (updated) {
+		nspre::Writer writer(options);
+		for (nspre::Subfile& subfile : in_files) {
+			writer.add(subfile);
+		}
+
+		err = writer.update(out_file, remove_paths);
+	}
+	else {
+		err = nspre::write(in_files, out_file, options);
+	}
+
+	if (err) {
 		switch (err) {
 		case nspre::Error::FILE_OPEN:
 			std::fprintf(stderr, "can't open input file\n");
 			break;
+		case nspre::Error::READ_HEADER:
+		case nspre::Error::READ_SUBHEADER:
+		case nspre::Error::READ_SUBPATH:
+		case nspre::Error::BAD_FILE:
+		case nspre::Error::READ_SUBFILE:
+			std::fprintf(stderr, "error reading file to update\n");
+			break;
 		case nspre::Error::FILE_OPEN_OUTPUT:
 			std::fprintf(stderr, "can't open output file\n");
 			break;
@@ -104,11 +182,41 @@ int main(int argc, char** argv)
 		case nspre::Error::WRITE_SUBFILE:
 			std::fprintf(stderr, "error writing file\n");
 			break;
+		case nspre::Error::NOT_FOUND:
+			std::fprintf(stderr, "a file to remove isn't in the pre file\n");
+			break;
+		case nspre::Error::TOO_LARGE:
+			std::fprintf(stderr, "output would be larger than a pre file can hold\n");
+			break;
 		default:
 			std::fprintf(stderr, "error (%d)\n", err);
 		}
 		return err;
 	}
 
+	// The limits are checked without opening the result with a Reader so --stats only counts the
+	// write. An update keeps files that weren't given, so its count comes from the new header.
+	size_t file_count = in_files.size();
+	if (updated) {
+		std::ifstream istream(out_file, std::ios::binary);
+		char header[12];
+		file_count = istream.read(header, 12) ? nspre::Read32LE<uint32_t>(header + 8) : 0;
+	}
+
+	std::error_code ec;
+	uintmax_t file_size = std::filesystem::file_size(out_file, ec);
+
+	if (file_count > NSPRE_MAX_COUNT) {
+		std::fprintf(stderr, "warning: %zu files is more than NSPRE_MAX_COUNT (%d) and won't open unless ReaderOptions::max_count is raised\n", file_count, NSPRE_MAX_COUNT);
+	}
+
+	if (!ec && file_size > NSPRE_MAX_SIZE) {
+		std::fprintf(stderr, "warning: %ju bytes is more than NSPRE_MAX_SIZE (%d) and won't open unless ReaderOptions::max_size is raised\n", file_size, NSPRE_MAX_SIZE);
+	}
+
+	if (show_stats) {
+		print_stats();
+	}
+
 	return 0;
 }
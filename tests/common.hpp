@@ -0,0 +1,100 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Shared by the tests. Include after nspre.hpp with NSPRE_IMPL defined, since archives are built
+// with the library's internal helpers.
+
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include "random.hpp"
+
+#define CHECK(x) do { if (!(x)) { std::printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #x); return 1; } } while (0)
+
+// A directory for one test's files, removed with everything in it when the test ends.
+struct TempDir {
+	std::filesystem::path path;
+
+	TempDir(const char* name) : path(std::filesystem::temp_directory_path() / name) {
+		std::filesystem::create_directories(path);
+	}
+
+	~TempDir() {
+		std::error_code ec;
+		std::filesystem::remove_all(path, ec);
+	}
+};
+
+// A subfile written exactly as described, so tests can build archives the Writer never would.
+// Anything left out is filled in the way the Writer would fill it.
+struct RawEntry {
+	std::string path;                        // Stored as given, then padded with nulls.
+	std::string data;                        // Written at data_offset, then padded to 4 bytes.
+	std::optional<unsigned int> crc;         // Default is the checksum of path.
+	std::optional<uint32_t> size;            // Default is data.size().
+	uint32_t cmp_size = 0;
+	std::optional<uint64_t> data_offset;     // Default is straight after the previous subfile.
+};
+
+// Writes a stored archive of entries. Space skipped by data_offset, and contents larger than data,
+// are left unwritten so huge archives are sparse files. header_size defaults to the end of the
+// last subfile. Returns false if an entry would overlap the one before it.
+inline bool write_archive(const std::filesystem::path& path, const std::vector<RawEntry>& entries, std::optional<uint32_t> header_size = std::nullopt) {
+	std::ofstream ostream(path, std::ios::binary | std::ios::trunc);
+	char header[12] = { 0, 0, 0, 0, 0x03, 0x00, static_cast<char>(0xcd), static_cast<char>(0xab) };
+	nspre::Write32LE<uint32_t>(header + 8, static_cast<uint32_t>(entries.size()));
+	ostream.write(header, 12);
+
+	uint64_t pos = 12;
+	for (const RawEntry& entry : entries) {
+		std::vector<char> path_buffer(entry.path.begin(), entry.path.end());
+		path_buffer.resize((path_buffer.size() / 4 + 1) * 4, 0);
+
+		uint64_t data_offset = entry.data_offset.value_or(pos + 16 + path_buffer.size());
+		if (data_offset < pos + 16 + path_buffer.size()) return false;
+
+		uint32_t size = entry.size.value_or(static_cast<uint32_t>(entry.data.size()));
+		char subheader[16];
+		nspre::Write32LE<uint32_t>(subheader, size);
+		nspre::Write32LE<uint32_t>(subheader + 4, entry.cmp_size);
+		nspre::Write32LE<uint32_t>(subheader + 8, static_cast<uint32_t>(path_buffer.size()));
+		nspre::Write32LE<unsigned int>(subheader + 12, entry.crc.value_or(nspre::string_crc(entry.path)));
+
+		ostream.seekp(data_offset - path_buffer.size() - 16);
+		ostream.write(subheader, 16);
+		ostream.write(path_buffer.data(), path_buffer.size());
+		ostream.write(entry.data.data(), entry.data.size());
+
+		uint64_t stored = entry.cmp_size ? entry.cmp_size : size;
+		uint64_t padded = (stored + 3) / 4 * 4;
+		if (entry.data.size() == stored) {
+			ostream.write("\0\0\0", padded - stored);
+		}
+
+		pos = data_offset + padded;
+	}
+
+	nspre::Write32LE<uint32_t>(header, header_size.value_or(static_cast<uint32_t>(pos)));
+	ostream.seekp(0);
+	ostream.write(header, 4);
+	return !ostream.fail();
+}
@@ -0,0 +1,149 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Writes inputs that compress, inputs that don't and inputs that only look like they do at every
+// compression level, and checks each is stored the way write_entry() decides and extracts back
+// to what was written in pieces of at most NSPRE_CHUNK_SIZE bytes.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include <cstring>
+#include "common.hpp"
+
+struct Input {
+	const char* name;
+	std::vector<char> data;
+	bool stored;   // Whether write_entry() should end up storing it rather than compressing it.
+};
+
+// Few distinct bytes so there are repeats of every length.
+std::vector<char> symbols(size_t size, Random& random) {
+	std::vector<char> data(size);
+	for (char& c : data) c = "abcd"[random.next() % 4];
+	return data;
+}
+
+int main() {
+	TempDir dir("nspre-test-compress");
+	Random random{ 0x9e3779b97f4a7c15 };
+
+	std::vector<Input> inputs;
+	inputs.push_back({ "empty", {}, true });
+	inputs.push_back({ "one byte", { 'x' }, true });
+	inputs.push_back({ "three bytes", { 'x', 'x', 'x' }, true });
+	inputs.push_back({ "zeros", std::vector<char>(100000, 0), false });
+	inputs.push_back({ "symbols", symbols(70000, random), false });
+	inputs.push_back({ "text", text(600000, random), false });
+	inputs.push_back({ "noise", noise(70000, random), true });
+
+	// The probe only sees the zeros, then compressing the rest makes it bigger than it is.
+	std::vector<char> tricky(NSPRE_PROBE_SIZE, 0);
+	std::vector<char> tail = noise(300000, random);
+	tricky.insert(tricky.end(), tail.begin(), tail.end());
+	inputs.push_back({ "zeros then noise", tricky, true });
+
+	CHECK(!nspre::compressible(inputs[6].data.data(), NSPRE_PROBE_SIZE));
+	CHECK(nspre::compressible(inputs[3].data.data(), NSPRE_PROBE_SIZE));
+	CHECK(nspre::compressible(inputs[5].data.data(), NSPRE_PROBE_SIZE));
+	CHECK(nspre::compressible(tricky.data(), NSPRE_PROBE_SIZE));
+
+	// The last input is also written from a file, which has to be read again when it's stored.
+	std::filesystem::path source = dir.path / "source.bin";
+	{
+		std::ofstream ostream(source, std::ios::binary);
+		ostream.write(tricky.data(), tricky.size());
+		CHECK(!ostream.fail());
+	}
+
+	for (int level = 1; level <= 9; ++level) {
+		nspre::WriterOptions options;
+		options.compress = true;
+		options.level = level;
+
+		auto add_inputs = [&](nspre::Writer& writer) {
+			for (size_t i = 0; i < inputs.size(); ++i) {
+				writer.add(inputs[i].data.data(), inputs[i].data.size(), "data\\" + std::to_string(i));
+			}
+			writer.add(source, "data\\source");
+		};
+
+		nspre::Writer writer(options);
+		add_inputs(writer);
+
+		std::filesystem::path path = dir.path / ("level" + std::to_string(level) + ".pre");
+		CHECK(writer.write(path) == 0);
+
+		// With threads, stored subfiles are handed back and streamed in order, and the result is
+		// the same.
+		options.threads = 4;
+		nspre::Writer threaded(options);
+		add_inputs(threaded);
+
+		std::vector<char> single(std::filesystem::file_size(path));
+		std::ifstream(path, std::ios::binary).read(single.data(), single.size());
+		std::vector<char> parallel;
+		CHECK(threaded.write(parallel) == 0);
+		CHECK(parallel == single);
+
+		// Even levels are read through a mapping, which hands out stored subfiles in place.
+		nspre::ReaderOptions reader_options;
+		reader_options.map = level % 2 == 0;
+		nspre::Reader reader(path, reader_options);
+		CHECK(reader.error() == 0);
+		CHECK(reader.files().size() == inputs.size() + 1);
+
+		for (size_t i = 0; i <= inputs.size(); ++i) {
+			const Input& input = i < inputs.size() ? inputs[i] : inputs.back();
+			nspre::Reader::Subfile& subfile = reader.files()[i];
+
+			if ((subfile.cmp_size() == 0) != input.stored) {
+				std::printf("level %d, %s: expected %s\n", level, input.name, input.stored ? "stored" : "compressed");
+				return 1;
+			}
+
+			if (!input.stored && static_cast<size_t>(subfile.cmp_size()) >= input.data.size()) {
+				std::printf("level %d, %s: compressed to %d bytes\n", level, input.name, subfile.cmp_size());
+				return 1;
+			}
+
+			std::vector<char> out;
+			CHECK(subfile.extract(out) == 0);
+			if (out != input.data) {
+				std::printf("level %d, %s: extract(std::vector<char>&) differs\n", level, input.name);
+				return 1;
+			}
+
+			out.clear();
+			size_t largest = 0;
+			CHECK(subfile.extract([&out, &largest](const char* data, size_t size) {
+				out.insert(out.end(), data, data + size);
+				largest = std::max(largest, size);
+				return 0;
+			}) == 0);
+			if (out != input.data || largest > NSPRE_CHUNK_SIZE) {
+				std::printf("level %d, %s: extract(Sink&&) differs\n", level, input.name);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Checks the slicing-by-8 and carry-less multiplication CRCs against going through crc_table a
+// byte at a time, for every length up to a few hundred bytes at every alignment.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include "common.hpp"
+
+unsigned int crc_bytewise(unsigned int crc, const char* buffer, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		crc = nspre::crc_table[static_cast<unsigned char>(crc) ^ static_cast<unsigned char>(buffer[i])] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+int main() {
+	Random random{ 0x2545f4914f6cdd1d };
+	std::vector<char> data = noise(1024 + 16, random);
+
+	// The standard check value.
+	CHECK(~nspre::buffer_crc("123456789", 9) == 0xcbf43926);
+	CHECK(nspre::string_crc("") == nspre::CRC_START);
+
+#ifdef NSPRE_CRC_CLMUL
+	bool clmul = nspre::crc_has_clmul();
+	if (!clmul) {
+		std::printf("PCLMULQDQ not supported, only checking slicing-by-8\n");
+	}
+#endif
+
+	for (size_t align = 0; align < 16; ++align) {
+		for (size_t size = 0; size <= 1024; size += size < 300 ? 1 : 61) {
+			const char* p = data.data() + align;
+			unsigned int start = static_cast<unsigned int>(random.next());
+			unsigned int want = crc_bytewise(start, p, size);
+
+			if (nspre::crc_update_slice8(start, p, size) != want ||
+				nspre::crc_update(start, p, size) != want ||
+				nspre::buffer_crc(p, size) != crc_bytewise(nspre::CRC_START, p, size)) {
+				std::printf("FAILED size %zu, alignment %zu\n", size, align);
+				return 1;
+			}
+
+#ifdef NSPRE_CRC_CLMUL
+			// Only called with at least 64 bytes, in multiples of 16.
+			if (clmul && size >= 64 && size % 16 == 0 && nspre::crc_update_clmul(start, p, size) != want) {
+				std::printf("FAILED clmul size %zu, alignment %zu\n", size, align);
+				return 1;
+			}
+#endif
+		}
+	}
+
+	return 0;
+}
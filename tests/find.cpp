@@ -0,0 +1,95 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Archives written by older tools have paths whose stored checksum doesn't match them, or that
+// use forward slashes. find() and Writer::update() have to locate those Subfiles by their paths
+// all the same.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include "common.hpp"
+
+int main() {
+	TempDir dir("nspre-test-find");
+	std::filesystem::path path = dir.path / "find.pre";
+
+	// The first is what the original ns-pack wrote for data/a.txt: the stored path has back
+	// slashes but the checksum is of the path as it was given.
+	CHECK(write_archive(path, {
+		{ "data\\a.txt", "a", nspre::string_crc("data/a.txt"), std::nullopt, 0, std::nullopt },
+		{ "data/b.txt", "bb", std::nullopt, std::nullopt, 0, std::nullopt },
+		{ "data\\c.txt", "ccc", 0x12345678, std::nullopt, 0, std::nullopt },
+		{ "data\\d.txt", "dddd", std::nullopt, std::nullopt, 0, std::nullopt },
+		{ "data\\a.txt", "second a", std::nullopt, std::nullopt, 0, std::nullopt },
+	}));
+	uintmax_t archive_size = std::filesystem::file_size(path);
+
+	nspre::Reader reader(path);
+	CHECK(reader.error() == 0);
+	CHECK(reader.files().size() == 5);
+
+	CHECK(reader.find("data\\a.txt") == &reader.files()[0]);
+	CHECK(reader.find("data/a.txt") == &reader.files()[0]);
+	CHECK(reader.find("data\\b.txt") == &reader.files()[1]);
+	CHECK(reader.find("data/b.txt") == &reader.files()[1]);
+	CHECK(reader.find("data\\c.txt") == &reader.files()[2]);
+	CHECK(reader.find("data\\d.txt") == &reader.files()[3]);
+	CHECK(reader.find("data\\e.txt") == nullptr);
+	CHECK(reader.find("data\\a.tx") == nullptr);
+	CHECK(reader.find("") == nullptr);
+
+	// Only the made up checksum fails verification.
+	CHECK(reader.files()[0].verify_path());
+	CHECK(reader.files()[1].verify_path());
+	CHECK(!reader.files()[2].verify_path());
+	CHECK(reader.files()[3].verify_path());
+	CHECK(reader.verify() == nspre::Error::BAD_CHECKSUM);
+
+	reader.close();
+
+	// Writer::update finds what to replace and remove the same way.
+	{
+		nspre::Writer writer;
+		writer.add(std::vector<char>{ 'n' }, "data/a.txt");
+		CHECK(writer.update(path, { "data\\b.txt", "data\\missing.txt" }) == nspre::Error::NOT_FOUND);
+		CHECK(std::filesystem::file_size(path) == archive_size);
+		CHECK(writer.update(path, { "data\\b.txt", "data/c.txt" }) == 0);
+	}
+
+	nspre::Reader updated(path);
+	CHECK(updated.error() == 0);
+	CHECK(updated.files().size() == 3);
+	CHECK(updated.find("data\\b.txt") == nullptr);
+	CHECK(updated.find("data\\c.txt") == nullptr);
+
+	std::vector<char> data;
+	CHECK(updated.find("data\\a.txt") == &updated.files()[0]);
+	CHECK(updated.files()[0].extract(data) == 0 && data == std::vector<char>{ 'n' });
+	CHECK(updated.files()[2].extract(data) == 0 && std::string(data.begin(), data.end()) == "second a");
+
+	// Removing a path drops every Subfile with it.
+	updated.close();
+	CHECK(nspre::Writer().update(path, { "data/a.txt" }) == 0);
+	CHECK(updated.open(path) == 0);
+	CHECK(updated.files().size() == 1);
+	CHECK(updated.files()[0].prepath() == "data\\d.txt");
+
+	return 0;
+}
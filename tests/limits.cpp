@@ -0,0 +1,189 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Runtime limits in ReaderOptions and WriterOptions, and archives at the 32 bit format ceiling.
+// The large archives are sparse files, so they take almost no space on disk.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include "common.hpp"
+
+const uint64_t ceiling = NSPRE_FORMAT_MAX_SIZE;
+
+int main() {
+	TempDir dir("nspre-test-limits");
+	std::filesystem::path path = dir.path / "limits.pre";
+
+	nspre::ReaderOptions unlimited;
+	unlimited.max_size = UINT64_MAX;
+	unlimited.max_count = SIZE_MAX;
+
+	// A stored subfile filling all but the end of the format's range, then a small one whose
+	// contents end right at it. Both paths take 4 bytes and every offset is a multiple of 4.
+	const uint64_t small_offset = ceiling - 11;
+	const uint64_t big_offset = 12 + 16 + 4;
+	const uint32_t big_size = static_cast<uint32_t>(small_offset - 16 - 4 - big_offset);
+	std::vector<RawEntry> at_ceiling = {
+		{ "big", "", std::nullopt, big_size, 0, big_offset },
+		{ "end", "ABCDEFGHIJK", std::nullopt, std::nullopt, 0, small_offset },
+	};
+
+	CHECK(write_archive(path, at_ceiling, static_cast<uint32_t>(ceiling)));
+	CHECK(std::filesystem::file_size(path) >= ceiling);
+
+	{
+		nspre::Reader reader(path);
+		CHECK(reader.error() == nspre::Error::BAD_FILE);
+	}
+
+	for (bool map : { false, true }) {
+		nspre::ReaderOptions options = unlimited;
+		options.map = map;
+
+		nspre::Reader reader(path, options);
+		CHECK(reader.error() == 0);
+		CHECK(reader.size() == static_cast<int>(ceiling));
+		CHECK(reader.files().size() == 2);
+		CHECK(reader.files()[0].size() == static_cast<int>(big_size));
+		CHECK(reader.files()[1].offset() == static_cast<int>(small_offset));
+
+		std::vector<char> data;
+		CHECK(reader.files()[1].extract(data) == 0);
+		CHECK(std::string(data.begin(), data.end()) == "ABCDEFGHIJK");
+		CHECK(reader.files()[0].extract_range(big_size - 16, 16, data) == 0 && data.size() == 16);
+		CHECK(reader.find("end") == &reader.files()[1]);
+	}
+
+	// max_size and max_count are exact.
+	{
+		nspre::ReaderOptions options;
+		options.max_size = ceiling - 1;
+		CHECK(nspre::Reader(path, options).error() == nspre::Error::BAD_FILE);
+		options.max_size = ceiling;
+		options.max_count = 1;
+		CHECK(nspre::Reader(path, options).error() == nspre::Error::BAD_FILE);
+		options.max_count = 2;
+		CHECK(nspre::Reader(path, options).error() == 0);
+	}
+
+	// Past the ceiling in the header.
+	CHECK(write_archive(path, at_ceiling, static_cast<uint32_t>(ceiling + 1)));
+	CHECK(nspre::Reader(path, unlimited).error() == nspre::Error::BAD_FILE);
+
+	// A subfile size or compressed size past the ceiling.
+	CHECK(write_archive(path, { { "a", "", std::nullopt, static_cast<uint32_t>(ceiling + 1), 0, std::nullopt } }, 64));
+	CHECK(nspre::Reader(path, unlimited).error() == nspre::Error::BAD_FILE);
+	CHECK(write_archive(path, { { "a", "", std::nullopt, 4, static_cast<uint32_t>(ceiling + 1), std::nullopt } }, 64));
+	CHECK(nspre::Reader(path, unlimited).error() == nspre::Error::BAD_FILE);
+	CHECK(write_archive(path, { { "a", "abcd", std::nullopt, std::nullopt, 0, std::nullopt } }, 64));
+	CHECK(nspre::Reader(path, unlimited).error() == 0);
+
+	// A subfile whose contents would start just past the ceiling.
+	const uint64_t past_offset = ceiling + 1;
+	CHECK(write_archive(path, {
+		{ "big", "", std::nullopt, static_cast<uint32_t>(past_offset - 16 - 4 - big_offset), 0, big_offset },
+		{ "end", "abcd", std::nullopt, std::nullopt, 0, past_offset },
+	}, static_cast<uint32_t>(ceiling)));
+	CHECK(nspre::Reader(path, unlimited).error() == nspre::Error::BAD_FILE);
+
+	// A count the header's size couldn't hold fails however high max_count is. Every subfile takes
+	// at least 20 bytes.
+	CHECK(write_archive(path, { { "a", "", std::nullopt, std::nullopt, 0, std::nullopt } }, NSPRE_MIN_SIZE));
+	CHECK(nspre::Reader(path, unlimited).error() == 0);
+	{
+		std::fstream stream(path, std::ios::binary | std::ios::in | std::ios::out);
+		char count[4];
+		nspre::Write32LE<uint32_t>(count, 2);
+		stream.seekp(8);
+		stream.write(count, 4);
+	}
+	CHECK(nspre::Reader(path, unlimited).error() == nspre::Error::BAD_FILE);
+
+	// A default Writer won't write more subfiles than a default Reader opens. Once max_count allows
+	// them they're written, and open once the Reader's max_count does too, from the file and from
+	// a sidecar index.
+	{
+		nspre::WriterOptions writer_options;
+		writer_options.max_count = NSPRE_MAX_COUNT + 100;
+
+		nspre::Writer writer;
+		nspre::Writer raised(writer_options);
+		for (int i = 0; i < NSPRE_MAX_COUNT + 100; ++i) {
+			writer.add(std::vector<char>(i % 7, 'x'), "data\\file" + std::to_string(i));
+			raised.add(std::vector<char>(i % 7, 'x'), "data\\file" + std::to_string(i));
+		}
+
+		std::vector<char> out;
+		CHECK(writer.write(out) == nspre::Error::TOO_LARGE);
+		CHECK(raised.write(path) == 0);
+		CHECK(nspre::Reader(path).error() == nspre::Error::BAD_FILE);
+
+		nspre::ReaderOptions options;
+		options.max_count = NSPRE_MAX_COUNT + 100;
+		options.index = dir.path / "limits.idx";
+		std::filesystem::remove(options.index);
+
+		for (int pass = 0; pass < 2; ++pass) {
+			nspre::Reader reader(path, options);
+			CHECK(reader.error() == 0);
+			CHECK(reader.files().size() == NSPRE_MAX_COUNT + 100);
+			CHECK(std::filesystem::exists(options.index));
+		}
+
+		options.max_count = NSPRE_MAX_COUNT + 99;
+		CHECK(nspre::Reader(path, options).error() == nspre::Error::BAD_FILE);
+	}
+
+	// Writing past the Writer's limits.
+	{
+		nspre::WriterOptions options;
+		options.max_count = 1;
+		nspre::Writer writer(options);
+		writer.add(std::vector<char>(4), "a");
+		writer.add(std::vector<char>(4), "b");
+
+		std::vector<char> out;
+		CHECK(writer.write(out) == nspre::Error::TOO_LARGE);
+		CHECK(out.empty());
+	}
+
+	for (unsigned int threads : { 1u, 4u }) {
+		nspre::WriterOptions options;
+		options.compress = true;
+		options.threads = threads;
+		options.max_size = 1000;
+
+		nspre::Writer writer(options);
+		for (int i = 0; i < 8; ++i) {
+			writer.add(std::vector<char>(500, static_cast<char>(i)), "file" + std::to_string(i));
+		}
+
+		std::vector<char> out;
+		CHECK(writer.write(out) == 0);
+		CHECK(out.size() <= 1000);
+
+		// Doesn't compress, so it's stored and takes the archive past max_size.
+		Random random{ 0x9e3779b97f4a7c15 };
+		writer.add(noise(1000, random), "noise");
+		CHECK(writer.write(out) == nspre::Error::TOO_LARGE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Generated data shared by the tests and nspre-bench.
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// xorshift64, so generated data is the same on every run and platform.
+struct Random {
+	uint64_t state;
+	uint64_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+};
+
+// Text from a small vocabulary, which compresses well.
+inline std::vector<char> text(size_t size, Random& random) {
+	static const char* const words[] = { "model ", "texture ", "sound ", "level ", "skater ", "board ", "\n" };
+	std::vector<char> data;
+	data.reserve(size + 8);
+	while (data.size() < size) {
+		const char* word = words[random.next() % 7];
+		data.insert(data.end(), word, word + std::strlen(word));
+	}
+
+	data.resize(size);
+	return data;
+}
+
+// Uniformly random bytes, which don't compress at all.
+inline std::vector<char> noise(size_t size, Random& random) {
+	std::vector<char> data(size);
+	for (char& c : data) c = static_cast<char>(random.next());
+	return data;
+}
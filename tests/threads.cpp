@@ -0,0 +1,126 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Extracts every subfile of one Reader from several threads at once, in stream and mapped mode,
+// and compares each result with the data the archive was written from.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "common.hpp"
+
+const int thread_count = 8;
+const int rounds = 4;
+
+// Each thread walks the subfiles from a different starting point so they overlap on different
+// subfiles, and uses a different way of extracting on each pass.
+int stress(nspre::Reader& reader, const std::vector<std::vector<char>>& expected) {
+	const size_t count = reader.files().size();
+	std::atomic<int> mismatches{0};
+
+	auto worker = [&](int t) {
+		std::vector<char> out;
+		for (int round = 0; round < rounds; ++round) {
+			for (size_t n = 0; n < count; ++n) {
+				size_t i = (n + t * count / thread_count) % count;
+				nspre::Reader::Subfile& subfile = reader.files()[i];
+				const std::vector<char>& want = expected[i];
+				int err = 0;
+				out.clear();
+
+				switch ((round + t) % 4) {
+				case 0:
+					err = subfile.extract(out);
+					break;
+				case 1:
+					out.resize(subfile.size());
+					err = subfile.extract(out.data());
+					break;
+				case 2:
+					err = subfile.extract([&out](const char* data, size_t size) {
+						out.insert(out.end(), data, data + size);
+						return 0;
+					});
+					break;
+				case 3: {
+					size_t half = want.size() / 2;
+					err = subfile.extract_range(half, want.size() - half, out);
+					if (!err && !std::equal(out.begin(), out.end(), want.begin() + half, want.end())) ++mismatches;
+					continue;
+				}
+				}
+
+				if (err || out != want) ++mismatches;
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int t = 0; t < thread_count; ++t) {
+		pool.emplace_back(worker, t);
+	}
+
+	for (std::thread& t : pool) {
+		t.join();
+	}
+
+	return mismatches;
+}
+
+int main() {
+	TempDir dir("nspre-test-threads");
+	std::filesystem::path path = dir.path / "threads.pre";
+
+	Random random{ 0x9e3779b97f4a7c15 };
+	std::vector<std::vector<char>> expected;
+	nspre::WriterOptions options;
+	options.compress = true;
+	options.threads = 0;
+
+	nspre::Writer writer(options);
+	for (int i = 0; i < 120; ++i) {
+		// Mostly small subfiles with a few past the 256 KiB extract_range checkpoint interval.
+		size_t size = i % 10 == 9 ? 300000 + random.next() % 300000 : random.next() % 20000;
+		// Text is stored compressed, noise is stored as it is.
+		expected.push_back(i % 3 != 0 ? text(size, random) : noise(size, random));
+		writer.add(expected.back().data(), expected.back().size(), "data\\file" + std::to_string(i));
+	}
+
+	CHECK(writer.write(path) == 0);
+
+	for (bool map : { false, true }) {
+		nspre::ReaderOptions reader_options;
+		reader_options.map = map;
+
+		nspre::Reader reader(path, reader_options);
+		CHECK(reader.error() == 0);
+		CHECK(reader.files().size() == expected.size());
+
+		int mismatches = stress(reader, expected);
+		std::printf("%s: %d mismatches\n", map ? "mapped" : "stream", mismatches);
+		CHECK(mismatches == 0);
+	}
+
+	return 0;
+}
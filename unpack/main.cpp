@@ -22,6 +22,11 @@
 #include "nspre.hpp"
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <mutex>
 
 std::filesystem::path inpath;
 std::filesystem::path outdir;
@@ -30,6 +35,12 @@ bool quiet = false;
 bool file_details = false;
 bool comma_separated = false;
 bool dry_run = false;
+bool show_stats = false;
+bool stats_json = false;
+unsigned int threads = 1;
+
+// Bytes of upcoming subfiles to have the system start reading while the current one extracts.
+const size_t read_ahead = 16 << 20;
 
 void print_help() {
 	std::printf(
@@ -40,6 +51,9 @@ void print_help() {
 		"  -v  Show details - Show name, path, compressed size, and actual size of each file\n"
 		"  -c  Show details with commas separating values instead of spaces\n"
 		"  -q  Quiet - Don't show total size and number of files\n"
+		"  -j  Number of files to extract at once - 0 uses one per core. Default is 1\n"
+		"  --stats       Show bytes read, read calls, lookups and time spent opening and extracting\n"
+		"  --stats=json  The same as JSON\n"
 		"  -h  Show this help message\n"
 		"\n"
 	);
@@ -50,7 +64,11 @@ bool arg_proc(int argc, char** argv) {
 		bool has_val = false;
 		if (argc > i + 1) has_val = true;
 
-		if (std::strlen(argv[i]) > 1 && argv[i][0] == '-') {
+		if (std::strcmp(argv[i], "--stats") == 0 || std::strcmp(argv[i], "--stats=json") == 0) {
+			show_stats = true;
+			stats_json = argv[i][7] == '=';
+		}
+		else if (std::strlen(argv[i]) > 1 && argv[i][0] == '-') {
 			if (std::strchr(argv[i], 'h')) {
 				print_help();
 				return true;
@@ -72,6 +90,10 @@ bool arg_proc(int argc, char** argv) {
 				outdir = argv[i + 1];
 				++i;
 			}
+			else if (has_val && std::strchr(argv[i], 'j')) {
+				threads = std::atoi(argv[i + 1]);
+				++i;
+			}
 		}
 		else {
 			inpath = argv[i];
@@ -81,6 +103,103 @@ bool arg_proc(int argc, char** argv) {
 	return false;
 }
 
+void print_stats() {
+#ifdef NSPRE_STATS
+	std::fputs(nspre::stats().report(stats_json).c_str(), stdout);
+#else
+	std::fprintf(stderr, "--stats isn't available, built without NSPRE_STATS\n");
+#endif
+}
+
+void print_extract_error(int err, size_t i) {
+	switch (err) {
+	case nspre::Error::FILE_OPEN_OUTPUT:
+		std::fprintf(stderr, "can't open output file\n");
+		break;
+	case nspre::Error::READ_HEADER:
+	case nspre::Error::READ_SUBHEADER:
+	case nspre::Error::READ_SUBPATH:
+	case nspre::Error::READ_SUBFILE:
+	case nspre::Error::EXTRACT_SUBFILE:
+	case nspre::Error::DECODE_SUBFILE:
+		std::fprintf(stderr, "error reading file %zu\n", i);
+		break;
+	default:
+		std::fprintf(stderr, "error (%d)\n", err);
+	}
+}
+
+int extract_serial(nspre::Reader& reader) {
+	for (size_t i = 0; i < reader.files().size(); ++i) {
+		reader.prefetch(i, read_ahead);
+		if (int err = reader.files()[i].extract(outdir / reader.files()[i].filename())) {
+			print_extract_error(err, i);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+// Subfiles that extract to the same filename are handled by one thread in their original order
+// so the last one still wins like it does in a serial run.
+int extract_parallel(nspre::Reader& reader) {
+	std::vector<std::vector<size_t>> groups;
+	std::map<std::string, size_t> group_index;
+	for (size_t i = 0; i < reader.files().size(); ++i) {
+		auto it = group_index.emplace(reader.files()[i].filename(), groups.size()).first;
+		if (it->second == groups.size()) groups.emplace_back();
+		groups[it->second].push_back(i);
+	}
+
+	std::vector<int> errors(reader.files().size(), 0);
+	std::mutex next_mutex;
+	size_t next = 0;
+	std::atomic<bool> failed{false};
+
+	// Groups are claimed in order of their first Subfile, and the prefetch for it is issued while
+	// claiming so the Reader sees them in index order instead of each thread moving the range back.
+	auto claim = [&]() {
+		std::lock_guard<std::mutex> lock(next_mutex);
+		if (next < groups.size()) {
+			reader.prefetch(groups[next][0], read_ahead);
+		}
+
+		return next++;
+	};
+
+	auto worker = [&]() {
+		for (size_t g = claim(); g < groups.size() && !failed; g = claim()) {
+			for (size_t i : groups[g]) {
+				if (int err = reader.files()[i].extract(outdir / reader.files()[i].filename())) {
+					errors[i] = err;
+					failed = true;
+					break;
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int t = 0; t < std::min<size_t>(threads, groups.size()); ++t) {
+		pool.emplace_back(worker);
+	}
+
+	for (std::thread& t : pool) {
+		t.join();
+	}
+
+	int first_err = 0;
+	for (size_t i = 0; i < errors.size(); ++i) {
+		if (errors[i]) {
+			print_extract_error(errors[i], i);
+			if (!first_err) first_err = errors[i];
+		}
+	}
+
+	return first_err;
+}
+
 int main(int argc, char** argv) {
 	if (arg_proc(argc, argv)) {
 		return 0;
@@ -92,7 +211,12 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
-	nspre::Reader reader(inpath);
+	nspre::ReaderOptions options;
+	options.advice = nspre::Advice::SEQUENTIAL;
+	options.max_size = NSPRE_FORMAT_MAX_SIZE;
+	options.max_count = NSPRE_FORMAT_MAX_SIZE;
+
+	nspre::Reader reader(inpath, options);
 	if (reader.error()) {
 		std::fprintf(stderr, "can't open input file\n");
 		return reader.error();
@@ -104,12 +228,16 @@ int main(int argc, char** argv) {
 	
 	if (file_details) {
 		char c = comma_separated ? ',' : ' ';
-		for (int i = 0; i < reader.files().size(); ++i) {
+		for (size_t i = 0; i < reader.files().size(); ++i) {
+			std::string_view filename = reader.files()[i].filename();
+			std::string_view prepath = reader.files()[i].prepath();
 			std::printf(
-				"%s%c%s%c%d%c%d\n",
-				reader.files()[i].filename().c_str(),
+				"%.*s%c%.*s%c%d%c%d\n",
+				static_cast<int>(filename.size()),
+				filename.data(),
 				c,
-				reader.files()[i].prepath().c_str(),
+				static_cast<int>(prepath.size()),
+				prepath.data(),
 				c,
 				reader.files()[i].cmp_size(),
 				c,
@@ -119,26 +247,18 @@ int main(int argc, char** argv) {
 	}
 
 	if (!dry_run) {
-		for (int i = 0; i < reader.files().size(); ++i) {
-			if (int err = reader.files()[i].extract(outdir / reader.files()[i].filename())) {
-				switch (err) {
-				case nspre::Error::FILE_OPEN_OUTPUT:
-					std::fprintf(stderr, "can't open output file\n");
-					break;
-				case nspre::Error::READ_HEADER:
-				case nspre::Error::READ_SUBHEADER:
-				case nspre::Error::READ_SUBPATH:
-				case nspre::Error::READ_SUBFILE:
-				case nspre::Error::EXTRACT_SUBFILE:
-					std::fprintf(stderr, "error reading file %d\n", i);
-					break;
-				default:
-					std::fprintf(stderr, "error (%d)\n", err);
-				}
-				return err;
-			}
+		if (threads == 0) threads = std::thread::hardware_concurrency();
+		if (threads == 0) threads = 1;
+
+		int err = threads > 1 ? extract_parallel(reader) : extract_serial(reader);
+		if (err) {
+			return err;
 		}
 	}
 
+	if (show_stats) {
+		print_stats();
+	}
+
 	return 0;
 }
@@ -0,0 +1,264 @@
+// Copyright (c) 2025 Bryan Rykowski
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define NSPRE_IMPL
+#include "nspre.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+
+std::vector<std::filesystem::path> inputs;
+unsigned int threads = 0;
+bool quiet = false;
+bool file_details = false;
+
+struct Failure {
+	std::string prepath;
+	std::string reason;
+	int error;
+};
+
+struct Result {
+	std::filesystem::path path;
+	size_t files = 0;
+	std::vector<Failure> failures;
+};
+
+void print_help() {
+	std::printf(
+		"ns-verify - Check that every file in pre files decodes, without writing anything.\n"
+		"Usage: ns-verify [OPTIONS] [INPUT FILES OR DIRECTORIES]\n"
+		"  Directories are searched for .pre and .prx files, including subdirectories\n"
+		"  -j  Number of pre files to check at once - 0 uses one per core. Default is 0\n"
+		"  -v  Show every pre file checked, not just the ones that failed\n"
+		"  -q  Quiet - Don't show the totals\n"
+		"  -h  Show this help message\n"
+		"\n"
+	);
+}
+
+bool arg_proc(int argc, char** argv) {
+	for (int i = 1; i < argc; ++i) {
+		bool has_val = false;
+		if (argc > i + 1) has_val = true;
+
+		if (std::strcmp(argv[i], "-h") == 0) {
+			print_help();
+			return true;
+		}
+		else if (std::strcmp(argv[i], "-v") == 0) {
+			file_details = true;
+		}
+		else if (std::strcmp(argv[i], "-q") == 0) {
+			quiet = true;
+		}
+		else if (has_val && std::strcmp(argv[i], "-j") == 0) {
+			threads = std::atoi(argv[++i]);
+		}
+		else {
+			inputs.push_back(argv[i]);
+		}
+	}
+
+	return false;
+}
+
+bool is_pre(const std::filesystem::path& path) {
+	std::string ext = path.extension().string();
+	for (char& c : ext) {
+		c = std::tolower(static_cast<unsigned char>(c));
+	}
+
+	return ext == ".pre" || ext == ".prx";
+}
+
+// Files named directly are checked whatever they're called. Directories are sorted so the
+// report comes out in the same order every run.
+std::vector<std::filesystem::path> collect(const std::vector<std::filesystem::path>& paths) {
+	std::vector<std::filesystem::path> out;
+	for (const std::filesystem::path& path : paths) {
+		std::error_code ec;
+		if (!std::filesystem::is_directory(path, ec)) {
+			out.push_back(path);
+			continue;
+		}
+
+		std::vector<std::filesystem::path> found;
+		for (auto it = std::filesystem::recursive_directory_iterator(path, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+			if (it->is_regular_file(ec) && is_pre(it->path())) {
+				found.push_back(it->path());
+			}
+		}
+
+		std::sort(found.begin(), found.end());
+		out.insert(out.end(), found.begin(), found.end());
+	}
+
+	return out;
+}
+
+std::string describe(int err) {
+	switch (err) {
+	case nspre::Error::FILE_OPEN:
+		return "can't open file";
+	case nspre::Error::READ_HEADER:
+	case nspre::Error::READ_SUBHEADER:
+	case nspre::Error::READ_SUBPATH:
+		return "file ends partway through a header";
+	case nspre::Error::BAD_FILE:
+		return "not a pre file or header values out of range";
+	case nspre::Error::READ_SUBFILE:
+		return "data runs past the end of the file";
+	case nspre::Error::DECODE_SUBFILE:
+		return "compressed data doesn't decode to exactly size() bytes from exactly cmp_size() bytes";
+	default:
+		return "error (" + std::to_string(err) + ")";
+	}
+}
+
+// The library's extract already fails unless the decoder uses up all cmp_size() bytes of input
+// and produces exactly size() bytes. The output is counted here as well so the check doesn't
+// depend on that.
+void check_subfile(nspre::Reader::Subfile& subfile, uint64_t archive_size, Result& result) {
+	std::string prepath(subfile.prepath());
+	auto fail = [&](const std::string& reason, int err) {
+		result.failures.push_back({prepath, reason, err});
+	};
+
+	if (!subfile.verify_path()) {
+		fail("path checksum doesn't match", nspre::Error::BAD_CHECKSUM);
+	}
+
+	if (subfile.size() < 0 || subfile.cmp_size() < 0) {
+		fail("negative size in header", nspre::Error::BAD_FILE);
+		return;
+	}
+
+	if (static_cast<uint64_t>(subfile.offset()) + subfile.raw_size() > archive_size) {
+		fail("data runs past the end of the file", nspre::Error::READ_SUBFILE);
+		return;
+	}
+
+	size_t produced = 0;
+	auto sink = [&produced](const char*, size_t count) {
+		produced += count;
+		return nspre::Error::NO_ERROR;
+	};
+
+	if (int err = subfile.extract(sink)) {
+		fail(describe(err), err);
+	}
+	else if (produced != static_cast<size_t>(subfile.size())) {
+		fail("decoded " + std::to_string(produced) + " bytes instead of " + std::to_string(subfile.size()), nspre::Error::DECODE_SUBFILE);
+	}
+}
+
+void check_archive(Result& result) {
+	nspre::ReaderOptions options;
+	options.advice = nspre::Advice::SEQUENTIAL;
+	options.max_size = NSPRE_FORMAT_MAX_SIZE;
+	options.max_count = NSPRE_FORMAT_MAX_SIZE;
+
+	nspre::Reader reader(result.path, options);
+	if (reader.error()) {
+		result.failures.push_back({"", describe(reader.error()), reader.error()});
+		return;
+	}
+
+	std::error_code ec;
+	uint64_t archive_size = std::filesystem::file_size(result.path, ec);
+	if (!ec && archive_size != static_cast<uint64_t>(reader.size())) {
+		result.failures.push_back({"", "size in header is " + std::to_string(reader.size()) + " but the file is " + std::to_string(archive_size), nspre::Error::BAD_FILE});
+		archive_size = std::min<uint64_t>(archive_size, reader.size());
+	}
+
+	result.files = reader.files().size();
+	for (nspre::Reader::Subfile& subfile : reader.files()) {
+		check_subfile(subfile, archive_size, result);
+	}
+}
+
+int main(int argc, char** argv) {
+	if (arg_proc(argc, argv)) {
+		return 0;
+	}
+
+	std::vector<std::filesystem::path> paths = collect(inputs);
+	if (paths.empty()) {
+		std::fprintf(stderr, "no input files\n");
+		print_help();
+		return -1;
+	}
+
+	if (threads == 0) threads = std::thread::hardware_concurrency();
+	if (threads == 0) threads = 1;
+
+	// Each worker opens, checks and closes one pre file at a time, so no more than threads files
+	// are open at once however many there are.
+	std::vector<Result> results(paths.size());
+	std::atomic<size_t> next{0};
+	auto worker = [&]() {
+		for (size_t i = next++; i < results.size(); i = next++) {
+			results[i].path = paths[i];
+			check_archive(results[i]);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int t = 0; t < std::min<size_t>(threads, paths.size()); ++t) {
+		pool.emplace_back(worker);
+	}
+
+	for (std::thread& t : pool) {
+		t.join();
+	}
+
+	size_t files = 0;
+	size_t failed = 0;
+	for (const Result& result : results) {
+		files += result.files;
+		if (result.failures.empty()) {
+			if (file_details) std::printf("ok      %s (%zu files)\n", result.path.string().c_str(), result.files);
+			continue;
+		}
+
+		++failed;
+
+		std::printf("FAILED  %s\n", result.path.string().c_str());
+		for (const Failure& failure : result.failures) {
+			if (failure.prepath.empty()) {
+				std::printf("        %s (error %d)\n", failure.reason.c_str(), failure.error);
+			}
+			else {
+				std::printf("        %s: %s (error %d)\n", failure.prepath.c_str(), failure.reason.c_str(), failure.error);
+			}
+		}
+	}
+
+	if (!quiet) {
+		std::printf("pre files: %zu\nfiles: %zu\nfailed: %zu\n", results.size(), files, failed);
+	}
+
+	// nspre error codes don't fit in an exit status, READ_SUBFILE would come out as 0, so they're
+	// only in the report.
+	return failed ? 1 : 0;
+}